@@ -1,6 +1,6 @@
 #include "env_table.h"
 #include <inttypes.h>
-#include <avr/pgmspace.h>
+#include "../hal.h"
 
 const uint16_t env_table[] PROGMEM =
 {
@@ -2,7 +2,7 @@
 #define ENV_TABLE_H
 
 #include <inttypes.h>
-#include <avr/pgmspace.h>
+#include "../hal.h"
 
 extern const uint16_t env_table[] PROGMEM;
 
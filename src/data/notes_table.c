@@ -1,6 +1,6 @@
 #include "notes_table.h"
 #include <inttypes.h>
-#include <avr/pgmspace.h>
+#include "../hal.h"
 
 /**
 	Compressed note frequency table
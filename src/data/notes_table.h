@@ -2,7 +2,7 @@
 #define NOTES_TABLE_H
 
 #include <inttypes.h>
-#include <avr/pgmspace.h>
+#include "../hal.h"
 
 extern const uint8_t notes_table[] PROGMEM;
 
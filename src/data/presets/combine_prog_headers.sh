@@ -1,5 +1,17 @@
 #!/bin/bash
 
+# With --index, prints offset of the first entry of each program
+# in the table instead of the table itself
+if [ "$1" == "--index" ]; then
+	shift
+	offset=0
+	for i in $(seq 1 $#); do
+		echo "$((offset + 1)),"
+		offset=$((offset + 1 + $(wc -l < "${!i}")))
+	done
+	exit 0
+fi
+
 for i in $(seq 1 $#); do
 	echo "MIDI_PROGRAM_BEGIN($i),";
 	cat "${!i}"
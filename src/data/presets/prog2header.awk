@@ -53,7 +53,22 @@ BEGIN {
 	ctls[$1] = $2;
 }
 
+# Entry as midi_program_load() applies it - the highest bit sets two controls
+function apply(param, value)
+{
+	if (param + 0 >= 128)
+	{
+		image[param - 128] = value;
+		image[param - 127] = value;
+	}
+	else
+		image[param] = value;
+}
+
 END {
+	for (n in defaults)
+		image[n] = defaults[n];
+
 	for (n in ctls)
 	{
 		# Both controls have the same value
@@ -61,12 +76,28 @@ END {
 		{
 			if (ctls[n] != defaults[n])
 			{
-				printf("{%d, %d},\n", n + 127, ctls[n]);
+				apply(n + 127, ctls[n]);
 			}
 		}
 		else if (ctls[n] != defaults[n] && (n % 2 == 0 || (n % 2 == 1 && ctls[n] != ctls[n - 1])))
 		{
-			printf("{%d, %d},\n", n, ctls[n]);
+			apply(n, ctls[n]);
+		}
+	}
+
+	# The program merged with the defaults, so that loading it
+	# doesn't need to load the defaults first
+	for (n = 0; n < 128; n++)
+	{
+		if (!(n in image))
+			continue;
+
+		if (n % 2 == 0 && (n + 1) in image && image[n] == image[n + 1])
+		{
+			printf("{%d, %d},\n", n + 128, image[n]);
+			n++;
 		}
+		else
+			printf("{%d, %d},\n", n, image[n]);
 	}
 }
@@ -0,0 +1,107 @@
+#ifndef HAL_H
+#define HAL_H
+
+/**
+	\file Hardware abstraction layer
+
+	On AVR this is a thin layer over avr-libc and the ATmega328P registers.
+	Anywhere else (the host build) flash and EEPROM data are plain const
+	arrays and the I/O hooks are implemented in host/hal_host.c
+*/
+
+#include <inttypes.h>
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+
+//! Drives one of the status LEDs on PORTD
+static inline void hal_led_write(uint8_t pin, uint8_t on)
+{
+	if (on)
+		PORTD |= (1 << pin);
+	else
+		PORTD &= ~(1 << pin);
+}
+
+//! Checks if a byte can be transmitted without waiting
+static inline uint8_t hal_midi_tx_ready(void)
+{
+	return UCSR0A & (1 << UDRE0);
+}
+
+//! Disables interrupts, returns state for hal_irq_restore()
+static inline uint8_t hal_irq_save(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	return sreg;
+}
+
+static inline void hal_irq_restore(uint8_t sreg)
+{
+	SREG = sreg;
+}
+
+//! Transmits one byte over the MIDI TX line
+static inline void hal_midi_tx(uint8_t byte)
+{
+	while (!(UCSR0A & (1 << UDRE0)));
+	UDR0 = byte;
+}
+
+#else
+
+#define PROGMEM
+#define EEMEM
+
+//! Flash is ordinary memory on the host
+static inline uint8_t pgm_read_byte(const void *addr)
+{
+	return *(const uint8_t*) addr;
+}
+
+//! Reads a little-endian word - the address does not have to be aligned
+static inline uint16_t pgm_read_word(const void *addr)
+{
+	const uint8_t *p = (const uint8_t*) addr;
+	return p[0] | (p[1] << 8);
+}
+
+//! EEPROM is ordinary memory on the host
+static inline uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+	return *addr;
+}
+
+static inline uint16_t eeprom_read_word(const uint16_t *addr)
+{
+	return *addr;
+}
+
+//! The host transmits immediately
+static inline uint8_t hal_midi_tx_ready(void)
+{
+	return 1;
+}
+
+//! The host feeds MIDI from the thread running the synth - nothing to disable
+static inline uint8_t hal_irq_save(void)
+{
+	return 0;
+}
+
+static inline void hal_irq_restore(uint8_t state)
+{
+	(void) state;
+}
+
+extern void hal_led_write(uint8_t pin, uint8_t on);
+extern void hal_midi_tx(uint8_t byte);
+
+#endif
+
+#endif
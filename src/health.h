@@ -0,0 +1,75 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <inttypes.h>
+
+/**
+	\file MIDI input health counters
+
+	The MIDI input buffer is a 256 byte ring written in the receive
+	interrupt. When it's full, incoming messages are dropped whole - a
+	message that doesn't fit is discarded together with all its remaining
+	bytes, so the parser never sees half of it. If the dropped message
+	carried a status byte, the status is inserted again before the next
+	message that fits, so running status stays correct. A dropped message
+	without running status (SysEx or system common) takes every data byte
+	up to the next status byte with it, so SysEx data is never taken for
+	notes or controllers.
+
+	The counters tell lost MIDI apart from CPU overrun. A report is
+	requested by setting MIDI_HEALTH and is sent as a SysEx message:
+
+		F0 7D 02 [high_water dropped_bytes dropped_messages late_samples] F7
+
+	Every value is sent as two 7-bit halves, low first, and saturates at
+	0x3fff. The counters are reset when the request is taken.
+*/
+
+//! Most bytes a single message may take in the input buffer
+#define USYNTH_HEALTH_MSG_MAX 3
+
+//! Largest value that fits in a report
+#define USYNTH_HEALTH_MAX 0x3fff
+
+//! Values sent in a health report
+typedef struct usynth_health_counters
+{
+	uint16_t high_water;        //!< Most bytes waiting in the input buffer
+	uint16_t dropped_bytes;
+	uint16_t dropped_messages;
+	uint16_t late_samples;      //!< Samples computed after the DAC needed them
+} usynth_health_counters;
+
+typedef struct usynth_midi_health
+{
+	usynth_health_counters counters;
+
+	// Receiver state - tracks message boundaries in the input stream
+	uint8_t rx_status;          //!< Running status (0 if none)
+	uint8_t rx_len;             //!< Data bytes per message with current status
+	uint8_t rx_left;            //!< Bytes left of the message being received
+	uint8_t rx_drop;            //!< Message being received is dropped
+	uint8_t rx_resend;          //!< Running status must be sent again
+} usynth_midi_health;
+
+static inline void usynth_health_count(uint16_t *counter)
+{
+	if (*counter < USYNTH_HEALTH_MAX) (*counter)++;
+}
+
+/**
+	Returns number of data bytes following given status byte
+	(0 for SysEx and real-time messages)
+*/
+static inline uint8_t usynth_health_msg_len(uint8_t status)
+{
+	const static uint8_t len_table[16] =
+	{
+		2, 2, 2, 2, 1, 1, 2, 0, // Channel messages 8x-Ex
+		0, 1, 2, 1, 0, 0, 0, 0, // SysEx and system common F0-F7
+	};
+
+	return len_table[status < 0xf0 ? (status >> 4) & 7 : 8 + (status & 7)];
+}
+
+#endif
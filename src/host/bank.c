@@ -0,0 +1,584 @@
+#include "bank.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hal.h"
+#include "../utils.h"
+#include "../mul.h"
+#include "../midi.h"
+#include "../midi_program.h"
+#include "../midi_cc.h"
+#include "../eg.h"
+#include "../lfo.h"
+#include "../filter.h"
+#include "../ppg/ppg.h"
+#include "../ppg/ppg_data.h"
+#include "../data/notes_table.h"
+#include "../data/env_table.h"
+#include "bank_osc.h"
+#include "bank_eg.h"
+#include "bank_lfo.h"
+
+// Same mapping of MIDI CC values as in usynth.c
+#define BANK_CTL(x) (bank->midi.control[(x)])
+#define BANK_CTL_S8(x) (((int8_t)(BANK_CTL((x))) - 64) << 1)
+#define BANK_CTL_U8(x) ((BANK_CTL((x))) << 1)
+
+//! All wavetables, loaded once and shared by all banks
+static ppg_wavetable_entry bank_wavetables[PPG_WAVETABLE_COUNT][PPG_DEFAULT_WAVETABLE_SIZE];
+static uint32_t bank_waveforms[256 * 64];
+static uint8_t bank_wavetables_ready;
+
+/**
+	Loads all wavetables and copies all waveforms they use into
+	bank_waveforms, so that the SIMD kernels can read them with
+	32-bit gathers
+*/
+static void bank_load_wavetables(void)
+{
+	if (bank_wavetables_ready)
+		return;
+
+	uint8_t max_wave = 0;
+	for (uint8_t i = 0; i < PPG_WAVETABLE_COUNT; i++)
+	{
+		ppg_load_wavetable_n(bank_wavetables[i], PPG_DEFAULT_WAVETABLE_SIZE, ppg_wavetable_data, i);
+		for (uint8_t w = 0; w < PPG_DEFAULT_WAVETABLE_SIZE; w++)
+			max_wave = MAX(max_wave, MAX(bank_wavetables[i][w].wave_l, bank_wavetables[i][w].wave_r));
+	}
+
+	for (size_t i = 0; i < (max_wave + 1u) * 64; i++)
+		bank_waveforms[i] = pgm_read_byte(ppg_waveforms_data + i);
+
+	bank_wavetables_ready = 1;
+}
+
+//! Returns the next aligned array of n elements of given size from the memory block
+static void *bank_carve(uint8_t **ptr, size_t n, size_t size)
+{
+	void *p = *ptr;
+	*ptr += (n * size + USYNTH_BANK_ALIGN - 1) & ~(size_t)(USYNTH_BANK_ALIGN - 1);
+	return p;
+}
+
+/**
+	Lays out all per-voice arrays in the memory block. With NULL block,
+	only computes the required size.
+
+	\returns number of bytes used
+*/
+static size_t bank_layout(usynth_bank *bank, uint8_t *block)
+{
+	uint8_t *p = block;
+	size_t n = bank->size;
+
+	#define BANK_ARRAY(field) (field) = bank_carve(&p, n, sizeof(*(field)))
+	BANK_ARRAY(bank->osc.phase);
+	BANK_ARRAY(bank->osc.phase_step);
+	BANK_ARRAY(bank->osc.wave);
+	BANK_ARRAY(bank->osc.wave_l);
+	BANK_ARRAY(bank->osc.wave_r);
+	BANK_ARRAY(bank->osc.factor);
+
+	BANK_ARRAY(bank->amp_eg.status);
+	BANK_ARRAY(bank->amp_eg.gate);
+	BANK_ARRAY(bank->amp_eg.value);
+	BANK_ARRAY(bank->amp_eg.output);
+	BANK_ARRAY(bank->mod_eg.status);
+	BANK_ARRAY(bank->mod_eg.gate);
+	BANK_ARRAY(bank->mod_eg.value);
+	BANK_ARRAY(bank->mod_eg.output);
+
+	BANK_ARRAY(bank->lfo.value);
+	BANK_ARRAY(bank->lfo.output);
+	BANK_ARRAY(bank->lfo.fade);
+	BANK_ARRAY(bank->lfo.status);
+	BANK_ARRAY(bank->lfo.gate);
+
+	BANK_ARRAY(bank->note);
+	BANK_ARRAY(bank->velocity);
+	BANK_ARRAY(bank->midi_gate);
+	BANK_ARRAY(bank->age);
+	BANK_ARRAY(bank->prev);
+	BANK_ARRAY(bank->next);
+	BANK_ARRAY(bank->note_prev);
+	BANK_ARRAY(bank->note_next);
+	bank->active = bank_carve(&p, n / USYNTH_BANK_LANES, sizeof(*bank->active));
+	bank->trig = bank_carve(&p, n / USYNTH_BANK_LANES, sizeof(*bank->trig));
+	#undef BANK_ARRAY
+
+	return p - block;
+}
+
+//! Inserts voice i after voice after (at the head if it's USYNTH_BANK_NONE)
+static void bank_list_insert(usynth_bank_list *list, uint32_t *prev, uint32_t *next, uint32_t i, uint32_t after)
+{
+	uint32_t before = after == USYNTH_BANK_NONE ? list->head : next[after];
+	prev[i] = after;
+	next[i] = before;
+
+	if (after == USYNTH_BANK_NONE)
+		list->head = i;
+	else
+		next[after] = i;
+
+	if (before == USYNTH_BANK_NONE)
+		list->tail = i;
+	else
+		prev[before] = i;
+}
+
+static void bank_list_remove(usynth_bank_list *list, uint32_t *prev, uint32_t *next, uint32_t i)
+{
+	if (prev[i] == USYNTH_BANK_NONE)
+		list->head = next[i];
+	else
+		next[prev[i]] = next[i];
+
+	if (next[i] == USYNTH_BANK_NONE)
+		list->tail = prev[i];
+	else
+		prev[next[i]] = prev[i];
+}
+
+//! Puts all voices in the free list, in order
+static void bank_alloc_init(usynth_bank *bank)
+{
+	bank->free_voices = bank->playing_voices = (usynth_bank_list){USYNTH_BANK_NONE, USYNTH_BANK_NONE};
+	for (size_t n = 0; n < 128; n++)
+		bank->note_voices[n] = (usynth_bank_list){USYNTH_BANK_NONE, USYNTH_BANK_NONE};
+
+	for (size_t i = 0; i < bank->voice_count; i++)
+		bank_list_insert(&bank->free_voices, bank->prev, bank->next, i, bank->free_voices.tail);
+}
+
+/**
+	Allocates a bank of voice_count voices rendered by given number
+	of threads and loads the initial program
+
+	\returns 0 on success
+*/
+int usynth_bank_init(usynth_bank *bank, size_t voice_count, unsigned threads)
+{
+	memset(bank, 0, sizeof(*bank));
+	if (!voice_count)
+		return -1;
+
+	bank->voice_count = voice_count;
+	bank->size = (voice_count + USYNTH_BANK_LANES - 1) / USYNTH_BANK_LANES * USYNTH_BANK_LANES;
+
+	// The mix is scaled down by the next power of two
+	while (((size_t) 1 << bank->mix_shift) < voice_count)
+		bank->mix_shift++;
+
+	size_t bytes = bank_layout(bank, NULL);
+	bank->memory = aligned_alloc(USYNTH_BANK_ALIGN, bytes);
+	if (!bank->memory)
+		return -1;
+	memset(bank->memory, 0, bytes);
+	bank_layout(bank, bank->memory);
+
+	if (usynth_pool_init(&bank->pool, threads))
+	{
+		usynth_bank_free(bank);
+		return -1;
+	}
+
+	bank->partial = aligned_alloc(USYNTH_BANK_ALIGN, (size_t) bank->pool.size * USYNTH_BANK_BLOCK * sizeof(bank->partial[0]));
+	bank->partial_used = calloc(bank->pool.size, 1);
+	if (!bank->partial || !bank->partial_used)
+	{
+		usynth_bank_free(bank);
+		return -1;
+	}
+
+	bank_load_wavetables();
+	bank->wavetable = bank_wavetables[0];
+	bank->waveforms = bank_waveforms;
+
+	// All LFOs start in the same phase
+	bank->lfo.share_phase = 1;
+	bank->lfo.shared = 1;
+
+	bank_alloc_init(bank);
+	midi_init(&bank->midi, 0);
+	midi_program_load(&bank->midi, 0);
+	return 0;
+}
+
+void usynth_bank_free(usynth_bank *bank)
+{
+	if (bank->pool.threads)
+		usynth_pool_free(&bank->pool);
+	free(bank->partial);
+	free(bank->partial_used);
+	free(bank->memory);
+	bank->partial = NULL;
+	bank->partial_used = NULL;
+	bank->memory = NULL;
+}
+
+/**
+	Allocates a voice for a new note - like midi_note_on(), prefers the
+	oldest (or with MIDI_POLY_REPLACE_NEWEST the newest) free voice,
+	otherwise replaces the oldest (newest) playing one
+*/
+static void bank_note_on(usynth_bank *bank, uint8_t note, uint8_t velocity)
+{
+#ifdef MIDI_POLY_REPLACE_NEWEST
+	uint32_t i = bank->free_voices.tail != USYNTH_BANK_NONE ? bank->free_voices.tail : bank->playing_voices.tail;
+#else
+	uint32_t i = bank->free_voices.head != USYNTH_BANK_NONE ? bank->free_voices.head : bank->playing_voices.head;
+#endif
+
+	if (bank->midi_gate[i])
+	{
+		bank_list_remove(&bank->playing_voices, bank->prev, bank->next, i);
+		bank_list_remove(&bank->note_voices[bank->note[i]], bank->note_prev, bank->note_next, i);
+	}
+	else
+		bank_list_remove(&bank->free_voices, bank->prev, bank->next, i);
+
+	// The new voice is the newest one
+	bank_list_insert(&bank->playing_voices, bank->prev, bank->next, i, bank->playing_voices.tail);
+	bank_list_insert(&bank->note_voices[note], bank->note_prev, bank->note_next, i, bank->note_voices[note].tail);
+
+	bank->midi_gate[i] = MIDI_GATE_ON_BIT;
+	bank->trig[i / USYNTH_BANK_LANES] |= 1 << (i % USYNTH_BANK_LANES);
+	bank->note[i] = note;
+	bank->velocity[i] = velocity;
+	bank->age[i] = ++bank->note_counter;
+	bank->pending_trig = 1;
+}
+
+/**
+	Releases all voices playing the note. The free list stays ordered by
+	age - notes are usually released in the order they were played, so
+	the position is found after skipping few (if any) newer free voices.
+*/
+static void bank_note_off(usynth_bank *bank, uint8_t note)
+{
+	uint32_t i;
+	while ((i = bank->note_voices[note].head) != USYNTH_BANK_NONE)
+	{
+		bank_list_remove(&bank->note_voices[note], bank->note_prev, bank->note_next, i);
+		bank_list_remove(&bank->playing_voices, bank->prev, bank->next, i);
+		bank->midi_gate[i] = 0;
+		bank->trig[i / USYNTH_BANK_LANES] &= ~(1 << (i % USYNTH_BANK_LANES));
+
+		uint32_t after = bank->free_voices.tail;
+		while (after != USYNTH_BANK_NONE && bank->age[after] > bank->age[i])
+			after = bank->prev[after];
+		bank_list_insert(&bank->free_voices, bank->prev, bank->next, i, after);
+	}
+}
+
+/**
+	Handles one complete channel message. Like the firmware, the bank
+	only listens on channel 0. Unlike the firmware, note on with zero
+	velocity releases the note, as MIDI files rely on that.
+*/
+void usynth_bank_midi(usynth_bank *bank, const uint8_t *data, uint8_t length)
+{
+	if (!length || (data[0] & 0x0f))
+		return;
+
+	uint8_t d0 = length > 1 ? data[1] : 0;
+	uint8_t d1 = length > 2 ? data[2] : 0;
+
+	switch (data[0] & 0xf0)
+	{
+		case 0x90:
+			if (d1)
+			{
+				bank_note_on(bank, d0, d1);
+				break;
+			}
+			// Fall through
+
+		case 0x80:
+			bank_note_off(bank, d0);
+			break;
+
+		case 0xb0:
+			midi_control_set(&bank->midi, d0 & 0x7f, d1);
+			break;
+
+		case 0xc0:
+			midi_program_load(&bank->midi, d0);
+			break;
+
+		case 0xe0:
+			bank->midi.pitchbend = d0 | (d1 << 7);
+			break;
+	}
+}
+
+//! Controllers bank_update_cc() derives the shared settings from
+static const uint8_t bank_cc[] =
+{
+	MIDI_OSC_BASE_WAVE(0), MIDI_EG_MOD_INT(0), MIDI_LFO_MOD_INT(0),
+	MIDI_AMP_A(0), MIDI_AMP_S(0), MIDI_AMP_R(0), MIDI_AMP_ASR(0),
+	MIDI_EG_A(0), MIDI_EG_S(0), MIDI_EG_R(0), MIDI_EG_ASR(0),
+	MIDI_EG_PITCH_INT(0), MIDI_LFO_PITCH_INT(0),
+	MIDI_LFO_RATE(0), MIDI_LFO_WAVE(0), MIDI_LFO_FADE(0),
+	MIDI_OSC_WAVETABLE(0),
+};
+
+/**
+	Shared settings from CC set 0 - see voice_update_cc_1() and voice_update_cc_2().
+	They are derived again only when one of their controllers has changed.
+*/
+static void bank_update_cc(usynth_bank *bank)
+{
+	uint8_t dirty = 0;
+	for (size_t i = 0; i < sizeof(bank_cc); i++)
+		dirty |= bank->midi.control_dirty[bank_cc[i] >> 3] & (1 << (bank_cc[i] & 7));
+
+	memset(bank->midi.control_dirty, 0, sizeof(bank->midi.control_dirty));
+	if (!dirty)
+		return;
+
+	bank->base_wave = BANK_CTL_S8(MIDI_OSC_BASE_WAVE(0));
+	bank->eg_mod_int = BANK_CTL_S8(MIDI_EG_MOD_INT(0));
+	bank->lfo_mod_int = BANK_CTL_S8(MIDI_LFO_MOD_INT(0));
+
+	bank->amp_eg.attack  = pgm_read_word(env_table + BANK_CTL(MIDI_AMP_A(0)));
+	bank->amp_eg.sustain = BANK_CTL_U8(MIDI_AMP_S(0));
+	bank->amp_eg.release = pgm_read_word(env_table + BANK_CTL(MIDI_AMP_R(0)));
+	bank->amp_eg.sustain_enabled = BANK_CTL(MIDI_AMP_ASR(0));
+
+	bank->mod_eg.attack  = pgm_read_word(env_table + BANK_CTL(MIDI_EG_A(0)));
+	bank->mod_eg.sustain = BANK_CTL_U8(MIDI_EG_S(0));
+	bank->mod_eg.release = pgm_read_word(env_table + BANK_CTL(MIDI_EG_R(0)));
+	bank->mod_eg.sustain_enabled = BANK_CTL(MIDI_EG_ASR(0));
+
+	bank->eg_pitch_int = (int8_t) BANK_CTL(MIDI_EG_PITCH_INT(0)) - 64;
+	bank->lfo_pitch_int = (int8_t) BANK_CTL(MIDI_LFO_PITCH_INT(0)) - 64;
+
+	bank->lfo.step = BANK_CTL_U8(MIDI_LFO_RATE(0)) << 1;
+	bank->lfo.waveform = BANK_CTL(MIDI_LFO_WAVE(0));
+	bank->lfo.fade_step = pgm_read_word(env_table + BANK_CTL(MIDI_LFO_FADE(0)));
+
+	// All wavetables are in memory, so a change takes effect immediately
+	bank->wavetable_number = MIN(BANK_CTL(MIDI_OSC_WAVETABLE(0)), PPG_WAVETABLE_COUNT - 1);
+	BANK_CTL(MIDI_OSC_WAVETABLE(0)) = bank->wavetable_number;
+	bank->wavetable = bank_wavetables[bank->wavetable_number];
+}
+
+//! \see voice_update_gate() - only the triggered voices are reset
+static void bank_update_gates(usynth_bank *bank, size_t first, size_t count)
+{
+	uint8_t sync = BANK_CTL(MIDI_LFO_SYNC);
+
+	for (size_t g = first / USYNTH_BANK_LANES; g < (first + count) / USYNTH_BANK_LANES; g++)
+	{
+		for (uint16_t trig = bank->trig[g]; trig; trig &= trig - 1)
+		{
+			size_t i = g * USYNTH_BANK_LANES + __builtin_ctz(trig);
+			bank->amp_eg.status[i] = USYNTH_EG_IDLE;
+			bank->amp_eg.value[i] = 0;
+			bank->mod_eg.status[i] = USYNTH_EG_IDLE;
+			bank->mod_eg.value[i] = 0;
+			bank->osc.phase[i] = 0;
+			bank->lfo.fade[i] = 0;
+			if (sync)
+				usynth_bank_lfo_sync(&bank->lfo, i);
+		}
+	}
+
+	for (size_t i = first; i < first + count; i++)
+	{
+		uint8_t gate = bank->midi_gate[i];
+		bank->amp_eg.gate[i] = gate;
+		bank->mod_eg.gate[i] = gate;
+		bank->lfo.gate[i] = gate;
+	}
+}
+
+//! \see voice_update_note()
+static void bank_update_notes(usynth_bank *bank, size_t first, size_t count)
+{
+	int16_t base = BANK_CTL(MIDI_OSC_PITCH(0)) - 64 - 4;
+	int16_t bend = (int16_t)(bank->midi.pitchbend >> 7) + BANK_CTL(MIDI_OSC_DETUNE(0));
+
+	for (size_t i = first; i < first + count; i++)
+	{
+		int16_t note = ((int16_t) bank->note[i] + base) << 5;
+		note += bend;
+		note += (bank->eg_pitch_int * (int8_t)(bank->mod_eg.output[i] >> 9)) >> 3;
+		note += (bank->lfo_pitch_int * (int8_t)(bank->lfo.output[i] >> 8)) >> 4;
+
+		note = note < 0 ? 0 : note;
+		note &= 4095;
+		bank->osc.phase_step[i] = pgm_read_delta_word(notes_table, note);
+	}
+}
+
+//! Selects the waveform of each voice - \see voice_update_mod()
+static void bank_update_mod(usynth_bank *bank, size_t first, size_t count)
+{
+	for (size_t i = first; i < first + count; i++)
+	{
+		int16_t mod = bank->base_wave;
+		mod += (bank->eg_mod_int * (int8_t)(bank->mod_eg.output[i] >> 9)) >> 5;
+		mod += (bank->lfo_mod_int * (int8_t)(bank->lfo.output[i] >> 8)) >> 6;
+		mod = 32 + (mod >> 2);
+
+		uint8_t wave = CLAMP(mod, 0, PPG_DEFAULT_WAVETABLE_SIZE - 1);
+		const ppg_wavetable_entry *e = &bank->wavetable[wave];
+		bank->osc.wave[i] = wave;
+		bank->osc.wave_l[i] = e->wave_l;
+		bank->osc.wave_r[i] = e->wave_r;
+		bank->osc.factor[i] = e->factor;
+	}
+}
+
+/**
+	Control work shared by all voices - CC updates, LFO sharing and
+	the update_global_1() part
+*/
+static void bank_control_global(usynth_bank *bank, usynth_bank_cycle *cycle)
+{
+	bank_update_cc(bank);
+
+	// A voice restarting its LFO gets out of phase with the others
+	if (bank->pending_trig && BANK_CTL(MIDI_LFO_SYNC))
+		usynth_bank_lfo_unshare(&bank->lfo, bank->size);
+	bank->pending_trig = 0;
+
+	// The voices are synced by bank_control_voices()
+	cycle->lfo_reset = BANK_CTL(MIDI_LFO_RESET) != 0;
+	if (cycle->lfo_reset)
+	{
+		BANK_CTL(MIDI_LFO_RESET) = 0;
+		usynth_bank_lfo_reset(&bank->lfo);
+	}
+
+	cycle->lfo_shared = bank->lfo.shared;
+	cycle->lfo_value = bank->lfo.shared ? usynth_bank_lfo_advance(&bank->lfo) : 0;
+	cycle->filter_cutoff = BANK_CTL(MIDI_CUTOFF) >> 1;
+}
+
+/**
+	Control work of count voices starting at first, in the order of
+	the firmware control slots
+*/
+static void bank_control_voices(usynth_bank *bank, const usynth_bank_cycle *cycle, size_t first, size_t count)
+{
+	bank_update_gates(bank, first, count);
+	bank_update_notes(bank, first, count);
+
+	// update_global_1()
+	if (cycle->lfo_reset)
+		for (size_t i = first; i < first + count; i++)
+		{
+			bank->lfo.value[i] = 0;
+			bank->lfo.output[i] = 0;
+			bank->lfo.status[i] = 0;
+		}
+
+	for (size_t g = first / USYNTH_BANK_LANES; g < (first + count) / USYNTH_BANK_LANES; g++)
+		bank->trig[g] = 0;
+
+	usynth_bank_eg_update(&bank->amp_eg, first, count);
+	usynth_bank_eg_update(&bank->mod_eg, first, count);
+	usynth_bank_lfo_update(&bank->lfo, first, count, cycle->lfo_shared, cycle->lfo_value);
+	bank_update_mod(bank, first, count);
+
+	// A voice with zero amplitude and no gate stays silent until the next cycle
+	for (size_t g = first / USYNTH_BANK_LANES; g < (first + count) / USYNTH_BANK_LANES; g++)
+	{
+		uint8_t active = 0;
+		for (size_t i = g * USYNTH_BANK_LANES; i < (g + 1) * USYNTH_BANK_LANES; i++)
+			active |= bank->amp_eg.value[i] != 0 || bank->amp_eg.gate[i];
+		bank->active[g] = active;
+	}
+}
+
+/**
+	Renders the current block for one lane group - runs all control
+	cycles of the block and adds the voices to the worker's partial mix
+*/
+static void bank_render_group(void *arg, size_t group, unsigned worker)
+{
+	usynth_bank *bank = arg;
+	uint32_t (*mix)[USYNTH_BANK_MIX_WIDTH] = bank->partial + (size_t) worker * USYNTH_BANK_BLOCK;
+	size_t first = group * USYNTH_BANK_LANES;
+
+	if (!bank->partial_used[worker])
+	{
+		memset(mix, 0, bank->block_length * sizeof(mix[0]));
+		bank->partial_used[worker] = 1;
+	}
+
+	uint8_t cnt = bank->control_cnt;
+	const usynth_bank_cycle *cycle = bank->cycles;
+	for (size_t pos = 0; pos < bank->block_length;)
+	{
+		if (cnt == 0)
+			bank_control_voices(bank, cycle++, first, USYNTH_BANK_LANES);
+
+		// Up to the end of the control cycle
+		uint8_t n = MIN(bank->block_length - pos, (size_t)(USYNTH_BANK_CONTROL_PERIOD - cnt));
+		if (bank->active[group])
+			usynth_bank_osc_render(bank, first, mix + pos, n);
+
+		pos += n;
+		cnt += n;
+		if (cnt == USYNTH_BANK_CONTROL_PERIOD)
+			cnt = 0;
+	}
+}
+
+/**
+	Renders a block of signed samples
+*/
+void usynth_bank_render(usynth_bank *bank, int16_t *out, size_t frames)
+{
+	while (frames)
+	{
+		size_t n = MIN(frames, (size_t) USYNTH_BANK_BLOCK);
+		bank->block_length = n;
+
+		// Global control work of all cycles starting in this block
+		uint8_t cnt = bank->control_cnt;
+		usynth_bank_cycle *cycle = bank->cycles;
+		for (size_t pos = 0; pos < n;)
+		{
+			if (cnt == 0)
+				bank_control_global(bank, cycle++);
+
+			uint8_t k = MIN(n - pos, (size_t)(USYNTH_BANK_CONTROL_PERIOD - cnt));
+			pos += k;
+			cnt = (cnt + k) % USYNTH_BANK_CONTROL_PERIOD;
+		}
+
+		memset(bank->partial_used, 0, bank->pool.size);
+		usynth_pool_run(&bank->pool, bank_render_group, bank, bank->size / USYNTH_BANK_LANES);
+
+		// The mix is summed at full precision and scaled down at once
+		cycle = bank->cycles;
+		for (size_t t = 0; t < n; t++)
+		{
+			if (bank->control_cnt == 0)
+				bank->filter_cutoff = (cycle++)->filter_cutoff;
+
+			uint32_t sum = 0;
+			for (unsigned w = 0; w < bank->pool.size; w++)
+				if (bank->partial_used[w])
+					for (uint8_t k = 0; k < USYNTH_BANK_MIX_WIDTH; k++)
+						sum += bank->partial[w * USYNTH_BANK_BLOCK + t][k];
+
+			int16_t x = (uint16_t)(sum >> bank->mix_shift) - 32768;
+			*out++ = filter1pole_feed(&bank->filter, bank->filter_cutoff, x);
+
+			if (++bank->control_cnt == USYNTH_BANK_CONTROL_PERIOD)
+				bank->control_cnt = 0;
+		}
+
+		frames -= n;
+	}
+}
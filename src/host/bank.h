@@ -0,0 +1,175 @@
+#ifndef BANK_H
+#define BANK_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "../midi.h"
+#include "../filter.h"
+#include "../ppg/ppg.h"
+#include "pool.h"
+
+/**
+	\file Voice bank - high polyphony host engine
+
+	The same DSP as a single chip, but with any number of voices, laid out
+	as structure of arrays. All voices play the same patch (CC set 0, poly
+	mode) and are allocated by the bank, not by midi_note_on(), so that
+	MIDI_MAX_VOICES doesn't limit the polyphony.
+
+	The control work of all voices is done at once, at the beginning of
+	each USYNTH_BANK_CONTROL_PERIOD sample cycle, in the same order as the
+	firmware does it in its load balancer slots. The cycle is as long as the
+	2-voice firmware one, so envelope and LFO timing is the same.
+
+	Output is rendered in blocks of up to USYNTH_BANK_BLOCK samples. The
+	global part of the control work of all cycles in the block is done
+	first. Then each lane group does its own control work and renders the
+	whole block into the partial mix of the worker that runs it - with
+	more than one thread, the lane groups are spread over a thread pool.
+	Finally the partial mixes are summed and filtered.
+*/
+
+//! Samples per control cycle
+#define USYNTH_BANK_CONTROL_PERIOD 21
+
+//! Voices are processed in groups of this many - the bank size is a multiple of it
+#define USYNTH_BANK_LANES 16
+
+//! Alignment of all per-voice arrays
+#define USYNTH_BANK_ALIGN 64
+
+//! Each sample of the mix is accumulated in this many partial sums
+#define USYNTH_BANK_MIX_WIDTH 8
+
+//! Maximum number of control cycles starting in one rendered block
+#define USYNTH_BANK_BLOCK_CYCLES 16
+#define USYNTH_BANK_BLOCK (USYNTH_BANK_BLOCK_CYCLES * USYNTH_BANK_CONTROL_PERIOD)
+
+//! End of a voice list
+#define USYNTH_BANK_NONE UINT32_MAX
+
+//! Doubly linked list of voices - the links are per-voice arrays
+typedef struct usynth_bank_list
+{
+	uint32_t head;
+	uint32_t tail;
+} usynth_bank_list;
+
+//! Envelope generators - per-voice state and shared settings
+typedef struct usynth_bank_eg
+{
+	uint8_t *status;
+	uint8_t *gate;
+	uint16_t *value;
+	uint16_t *output;
+
+	uint16_t attack;
+	uint16_t release;
+	uint8_t sustain;
+	uint8_t sustain_enabled;
+} usynth_bank_eg;
+
+//! LFOs - per-voice state and shared settings
+typedef struct usynth_bank_lfo
+{
+	int16_t *value;
+	int16_t *output;
+	uint16_t *fade;
+	uint8_t *status;
+	uint8_t *gate;
+
+	int16_t step;
+	uint16_t fade_step;
+	uint8_t waveform;
+
+	uint8_t share_phase;   //!< Allows sharing the phase when all LFOs are in sync
+	uint8_t shared;        //!< The voices use the common phase, value and status are not valid
+	int16_t common_value;
+	uint8_t common_status;
+} usynth_bank_lfo;
+
+//! Oscillators - the current wavetable entry is resolved for each voice
+typedef struct usynth_bank_osc
+{
+	uint16_t *phase;
+	uint16_t *phase_step;
+	uint8_t *wave;
+	uint8_t *wave_l;
+	uint8_t *wave_r;
+	uint8_t *factor;
+} usynth_bank_osc;
+
+//! Results of the global control work of one cycle
+typedef struct usynth_bank_cycle
+{
+	uint8_t lfo_reset;
+	uint8_t lfo_shared;
+	int16_t lfo_value;     //!< Common LFO value if the LFOs are shared
+	int8_t filter_cutoff;
+} usynth_bank_cycle;
+
+typedef struct usynth_bank
+{
+	size_t size;           //!< Number of voices (multiple of USYNTH_BANK_LANES)
+	size_t voice_count;    //!< Number of voices used for playing
+	uint8_t mix_shift;     //!< Mix is scaled down by 2^mix_shift
+	void *memory;
+
+	// Per-voice state
+	usynth_bank_osc osc;
+	usynth_bank_eg amp_eg;
+	usynth_bank_eg mod_eg;
+	usynth_bank_lfo lfo;
+	uint8_t *note;
+	uint8_t *velocity;
+	uint8_t *midi_gate;    //!< MIDI_GATE_ON_BIT or 0
+	uint32_t *age;         //!< Note on counter value when the voice was allocated
+	uint32_t *prev;        //!< Links in the free or the playing list
+	uint32_t *next;
+	uint32_t *note_prev;   //!< Links in the list of voices playing the same note
+	uint32_t *note_next;
+	uint8_t *active;       //!< Non-zero for lane groups with at least one sounding voice
+	uint16_t *trig;        //!< Per lane group - one bit per voice triggered since the last control cycle
+
+	// Shared modulation settings
+	int8_t base_wave;
+	int8_t eg_mod_int;
+	int8_t lfo_mod_int;
+	int8_t eg_pitch_int;
+	int8_t lfo_pitch_int;
+	uint8_t wavetable_number;
+	const ppg_wavetable_entry *wavetable;
+	const uint32_t *waveforms;  //!< ppg_waveforms_data widened for SIMD gathers
+
+	/**
+		Voice allocation - the free and the playing voices are kept
+		in two lists ordered by age, oldest first. Each note has its
+		own list of voices playing it.
+	*/
+	usynth_bank_list free_voices;
+	usynth_bank_list playing_voices;
+	usynth_bank_list note_voices[128];
+	uint32_t note_counter;
+
+	// Controls, program and pitch bend - the voice part is not used
+	midi_status midi;
+	uint8_t pending_trig;  //!< A note was triggered since the last control cycle
+
+	filter1pole filter;
+	int8_t filter_cutoff;
+	uint8_t control_cnt;   //!< Position in the control cycle
+
+	// Block rendering
+	usynth_bank_cycle cycles[USYNTH_BANK_BLOCK_CYCLES];
+	size_t block_length;
+	usynth_pool pool;
+	uint32_t (*partial)[USYNTH_BANK_MIX_WIDTH];  //!< USYNTH_BANK_BLOCK samples per worker
+	uint8_t *partial_used;                       //!< Worker has rendered something in this block
+} usynth_bank;
+
+extern int usynth_bank_init(usynth_bank *bank, size_t voice_count, unsigned threads);
+extern void usynth_bank_free(usynth_bank *bank);
+extern void usynth_bank_midi(usynth_bank *bank, const uint8_t *data, uint8_t length);
+extern void usynth_bank_render(usynth_bank *bank, int16_t *out, size_t frames);
+
+#endif
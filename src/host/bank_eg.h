@@ -0,0 +1,159 @@
+#ifndef BANK_EG_H
+#define BANK_EG_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "bank.h"
+#include "../eg.h"
+
+#if !defined(USYNTH_BANK_SCALAR) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
+
+/**
+	\file Voice bank envelope generator kernels
+
+	Batch versions of usynth_eg_update() - the state switch is replaced
+	by masks computed for all states at once:
+	 - attack adds with unsigned saturation, which gives UINT16_MAX
+	   exactly when the firmware detects the overflow (tmp < value)
+	 - release subtracts with unsigned saturation, which gives 0 exactly
+	   when the firmware detects the underflow (tmp > value)
+	 - the sustain scaling is mulhi_epu16(value, sustain << 8)
+
+	The kernels work on count envelopes starting at first - both have to
+	be multiples of USYNTH_BANK_LANES.
+*/
+
+//! Scalar reference - runs usynth_eg_update() on each envelope
+static inline void usynth_bank_eg_update_scalar(usynth_bank_eg *eg, size_t first, size_t count)
+{
+	usynth_eg e = {
+		.attack = eg->attack,
+		.release = eg->release,
+		.sustain = eg->sustain,
+		.sustain_enabled = eg->sustain_enabled,
+	};
+
+	for (size_t i = first; i < first + count; i++)
+	{
+		e.gate = eg->gate[i];
+		e.status = eg->status[i];
+		e.value = eg->value[i];
+		usynth_eg_update(&e);
+		eg->status[i] = e.status;
+		eg->value[i] = e.value;
+		eg->output[i] = e.output;
+	}
+}
+
+#if !defined(USYNTH_BANK_SCALAR) && defined(__AVX2__)
+
+//! AVX2 kernel - 16 envelopes at once
+static inline void usynth_bank_eg_update(usynth_bank_eg *eg, size_t first, size_t count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i attack = _mm256_set1_epi16(eg->attack);
+	const __m256i release = _mm256_set1_epi16(eg->release);
+	const __m256i sustain = _mm256_set1_epi16(eg->sustain << 8);
+	const __m256i no_sustain = _mm256_set1_epi16(eg->sustain_enabled ? 0 : -1);
+	const __m256i st_attack = _mm256_set1_epi16(USYNTH_EG_ATTACK);
+	const __m256i st_sustain = _mm256_set1_epi16(USYNTH_EG_SUSTAIN);
+	const __m256i st_release = _mm256_set1_epi16(USYNTH_EG_RELEASE);
+
+	for (size_t i = first; i < first + count; i += 16)
+	{
+		__m256i status = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &eg->status[i]));
+		__m256i gate = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &eg->gate[i]));
+		__m256i value = _mm256_load_si256((const __m256i*) &eg->value[i]);
+
+		__m256i no_gate = _mm256_cmpeq_epi16(gate, zero);
+		__m256i is_idle = _mm256_cmpeq_epi16(status, zero);
+		__m256i is_attack = _mm256_cmpeq_epi16(status, st_attack);
+		__m256i is_sustain = _mm256_cmpeq_epi16(status, st_sustain);
+		__m256i is_release = _mm256_cmpeq_epi16(status, st_release);
+
+		__m256i attacking = _mm256_andnot_si256(no_gate, is_attack);
+		__m256i attacked = _mm256_adds_epu16(value, attack);
+		__m256i overflow = _mm256_andnot_si256(_mm256_cmpeq_epi16(attacked, _mm256_add_epi16(value, attack)), attacking);
+
+		value = _mm256_blendv_epi8(value, _mm256_subs_epu16(value, release), is_release);
+		value = _mm256_blendv_epi8(value, attacked, attacking);
+
+		__m256i to_release = _mm256_or_si256(
+			_mm256_and_si256(_mm256_or_si256(is_attack, is_sustain), no_gate),
+			_mm256_and_si256(is_sustain, no_sustain));
+		status = _mm256_blendv_epi8(status, st_attack, _mm256_andnot_si256(no_gate, is_idle));
+		status = _mm256_blendv_epi8(status, st_sustain, overflow);
+		status = _mm256_blendv_epi8(status, st_release, to_release);
+
+		// packus works within 128-bit halves
+		status = _mm256_permute4x64_epi64(_mm256_packus_epi16(status, zero), 0xd8);
+		_mm_store_si128((__m128i*) &eg->status[i], _mm256_castsi256_si128(status));
+		_mm256_store_si256((__m256i*) &eg->value[i], value);
+		_mm256_store_si256((__m256i*) &eg->output[i], _mm256_mulhi_epu16(value, sustain));
+	}
+}
+
+#elif !defined(USYNTH_BANK_SCALAR) && defined(__SSE2__)
+
+//! Bitwise select - mask ? a : b
+static inline __m128i usynth_bank_eg_select(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+//! SSE2 kernel - 8 envelopes at once
+static inline void usynth_bank_eg_update(usynth_bank_eg *eg, size_t first, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i attack = _mm_set1_epi16(eg->attack);
+	const __m128i release = _mm_set1_epi16(eg->release);
+	const __m128i sustain = _mm_set1_epi16(eg->sustain << 8);
+	const __m128i no_sustain = _mm_set1_epi16(eg->sustain_enabled ? 0 : -1);
+	const __m128i st_attack = _mm_set1_epi16(USYNTH_EG_ATTACK);
+	const __m128i st_sustain = _mm_set1_epi16(USYNTH_EG_SUSTAIN);
+	const __m128i st_release = _mm_set1_epi16(USYNTH_EG_RELEASE);
+
+	for (size_t i = first; i < first + count; i += 8)
+	{
+		__m128i status = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &eg->status[i]), zero);
+		__m128i gate = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &eg->gate[i]), zero);
+		__m128i value = _mm_load_si128((const __m128i*) &eg->value[i]);
+
+		__m128i no_gate = _mm_cmpeq_epi16(gate, zero);
+		__m128i is_idle = _mm_cmpeq_epi16(status, zero);
+		__m128i is_attack = _mm_cmpeq_epi16(status, st_attack);
+		__m128i is_sustain = _mm_cmpeq_epi16(status, st_sustain);
+		__m128i is_release = _mm_cmpeq_epi16(status, st_release);
+
+		__m128i attacking = _mm_andnot_si128(no_gate, is_attack);
+		__m128i attacked = _mm_adds_epu16(value, attack);
+		__m128i overflow = _mm_andnot_si128(_mm_cmpeq_epi16(attacked, _mm_add_epi16(value, attack)), attacking);
+
+		value = usynth_bank_eg_select(is_release, _mm_subs_epu16(value, release), value);
+		value = usynth_bank_eg_select(attacking, attacked, value);
+
+		__m128i to_release = _mm_or_si128(
+			_mm_and_si128(_mm_or_si128(is_attack, is_sustain), no_gate),
+			_mm_and_si128(is_sustain, no_sustain));
+		status = usynth_bank_eg_select(_mm_andnot_si128(no_gate, is_idle), st_attack, status);
+		status = usynth_bank_eg_select(overflow, st_sustain, status);
+		status = usynth_bank_eg_select(to_release, st_release, status);
+
+		_mm_storel_epi64((__m128i*) &eg->status[i], _mm_packus_epi16(status, zero));
+		_mm_store_si128((__m128i*) &eg->value[i], value);
+		_mm_store_si128((__m128i*) &eg->output[i], _mm_mulhi_epu16(value, sustain));
+	}
+}
+
+#else
+
+static inline void usynth_bank_eg_update(usynth_bank_eg *eg, size_t first, size_t count)
+{
+	usynth_bank_eg_update_scalar(eg, first, count);
+}
+
+#endif
+
+#endif
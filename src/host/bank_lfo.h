@@ -0,0 +1,243 @@
+#ifndef BANK_LFO_H
+#define BANK_LFO_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "bank.h"
+#include "../mul.h"
+#include "../lfo.h"
+
+#if !defined(USYNTH_BANK_SCALAR) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
+
+/**
+	\file Voice bank LFO kernels
+
+	Batch versions of usynth_lfo_update(). All LFOs of the bank run at the
+	same rate, so unless LFO_SYNC restarts them on each note, they are all
+	in the same phase. In that case (lfo->shared), the common phase is
+	advanced once per control cycle by usynth_bank_lfo_advance() and every
+	voice just applies its own fade to the common value.
+
+	The SIMD kernels do the triangle fold with wrapping 16-bit arithmetic
+	and signed compares, the fade with a saturating add and
+	MUL_S16_U16_16H(v, f) as mulhi_epi16(v, f) + (f >= 32768 ? v : 0).
+
+	The kernels work on count LFOs starting at first - both have to be
+	multiples of USYNTH_BANK_LANES.
+*/
+
+//! Scalar reference - runs usynth_lfo_update() on each LFO, ignores sharing
+static inline void usynth_bank_lfo_update_scalar(usynth_bank_lfo *lfo, size_t first, size_t count)
+{
+	usynth_lfo l = {
+		.step = lfo->step,
+		.waveform = lfo->waveform,
+		.fade_step = lfo->fade_step,
+	};
+
+	for (size_t i = first; i < first + count; i++)
+	{
+		l.fade = lfo->fade[i];
+		l.value = lfo->value[i];
+		l.status = lfo->status[i];
+		l.gate = lfo->gate[i];
+		usynth_lfo_update(&l);
+		lfo->fade[i] = l.fade;
+		lfo->value[i] = l.value;
+		lfo->output[i] = l.output;
+		lfo->status[i] = l.status;
+	}
+}
+
+//! Gives each LFO its own copy of the common phase
+static inline void usynth_bank_lfo_unshare(usynth_bank_lfo *lfo, size_t size)
+{
+	if (!lfo->shared)
+		return;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		lfo->value[i] = lfo->common_value;
+		lfo->status[i] = lfo->common_status;
+	}
+	lfo->shared = 0;
+}
+
+//! usynth_lfo_sync() of a single voice - the LFOs must not be shared
+static inline void usynth_bank_lfo_sync(usynth_bank_lfo *lfo, size_t i)
+{
+	lfo->value[i] = 0;
+	lfo->output[i] = 0;
+	lfo->status[i] = 0;
+}
+
+//! Restarts the common phase - the voices have to be synced too
+static inline void usynth_bank_lfo_reset(usynth_bank_lfo *lfo)
+{
+	lfo->common_value = 0;
+	lfo->common_status = 0;
+	lfo->shared = lfo->share_phase;
+}
+
+/**
+	Advances the common phase - the triangle part of usynth_lfo_update()
+
+	\returns the new common value
+*/
+static inline int16_t usynth_bank_lfo_advance(usynth_bank_lfo *lfo)
+{
+	usynth_lfo l = {
+		.step = lfo->step,
+		.value = lfo->common_value,
+		.status = lfo->common_status,
+	};
+
+	usynth_lfo_update(&l);
+	lfo->common_value = l.value;
+	lfo->common_status = l.status;
+	return l.value;
+}
+
+#if !defined(USYNTH_BANK_SCALAR) && defined(__AVX2__)
+
+//! AVX2 kernel - 16 LFOs at once
+static inline void usynth_bank_lfo_update(usynth_bank_lfo *lfo, size_t first, size_t count, uint8_t shared, int16_t common_value)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i dir_bit = _mm256_set1_epi16(USYNTH_LFO_DIR_BIT);
+	const __m256i step = _mm256_set1_epi16(lfo->step);
+	const __m256i top = _mm256_set1_epi16(INT16_MAX - lfo->step);
+	const __m256i bottom = _mm256_set1_epi16(INT16_MIN + lfo->step);
+	const __m256i max = _mm256_set1_epi16(INT16_MAX);
+	const __m256i min = _mm256_set1_epi16(INT16_MIN);
+	const __m256i fade_step = _mm256_set1_epi16(lfo->fade_step);
+	const __m256i triangle = _mm256_set1_epi16(lfo->waveform == USYNTH_LFO_TRIANGLE ? -1 : 0);
+	const __m256i common = _mm256_set1_epi16(common_value);
+
+	for (size_t i = first; i < first + count; i += 16)
+	{
+		__m256i value = common;
+
+		if (!shared)
+		{
+			value = _mm256_load_si256((const __m256i*) &lfo->value[i]);
+			__m256i status = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &lfo->status[i]));
+			__m256i up = _mm256_cmpeq_epi16(_mm256_and_si256(status, dir_bit), dir_bit);
+
+			// Folds back from the top or the bottom
+			__m256i fold_top = _mm256_and_si256(up, _mm256_cmpgt_epi16(value, top));
+			__m256i fold_bottom = _mm256_andnot_si256(up, _mm256_cmpgt_epi16(bottom, value));
+			__m256i fold = _mm256_or_si256(fold_top, fold_bottom);
+
+			__m256i moved = _mm256_blendv_epi8(_mm256_sub_epi16(value, step), _mm256_add_epi16(value, step), up);
+			__m256i folded = _mm256_sub_epi16(_mm256_blendv_epi8(min, max, up), _mm256_sub_epi16(value, _mm256_blendv_epi8(bottom, top, up)));
+			value = _mm256_blendv_epi8(moved, folded, fold);
+			status = _mm256_xor_si256(status, _mm256_and_si256(fold, dir_bit));
+
+			status = _mm256_permute4x64_epi64(_mm256_packus_epi16(status, zero), 0xd8);
+			_mm_store_si128((__m128i*) &lfo->status[i], _mm256_castsi256_si128(status));
+			_mm256_store_si256((__m256i*) &lfo->value[i], value);
+		}
+
+		// Fade
+		__m256i fade = _mm256_load_si256((const __m256i*) &lfo->fade[i]);
+		__m256i gate = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &lfo->gate[i]));
+		fade = _mm256_blendv_epi8(_mm256_adds_epu16(fade, fade_step), fade, _mm256_cmpeq_epi16(gate, zero));
+		_mm256_store_si256((__m256i*) &lfo->fade[i], fade);
+
+		// Waveform
+		__m256i tri = _mm256_add_epi16(_mm256_mulhi_epi16(value, fade), _mm256_and_si256(_mm256_srai_epi16(fade, 15), value));
+		__m256i half = _mm256_srli_epi16(fade, 1);
+		__m256i square = _mm256_blendv_epi8(_mm256_sub_epi16(zero, half), half, _mm256_cmpgt_epi16(value, zero));
+		_mm256_store_si256((__m256i*) &lfo->output[i], _mm256_blendv_epi8(square, tri, triangle));
+	}
+}
+
+#elif !defined(USYNTH_BANK_SCALAR) && defined(__SSE2__)
+
+//! Bitwise select - mask ? a : b
+static inline __m128i usynth_bank_lfo_select(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+//! SSE2 kernel - 8 LFOs at once
+static inline void usynth_bank_lfo_update(usynth_bank_lfo *lfo, size_t first, size_t count, uint8_t shared, int16_t common_value)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i dir_bit = _mm_set1_epi16(USYNTH_LFO_DIR_BIT);
+	const __m128i step = _mm_set1_epi16(lfo->step);
+	const __m128i top = _mm_set1_epi16(INT16_MAX - lfo->step);
+	const __m128i bottom = _mm_set1_epi16(INT16_MIN + lfo->step);
+	const __m128i max = _mm_set1_epi16(INT16_MAX);
+	const __m128i min = _mm_set1_epi16(INT16_MIN);
+	const __m128i fade_step = _mm_set1_epi16(lfo->fade_step);
+	const __m128i triangle = _mm_set1_epi16(lfo->waveform == USYNTH_LFO_TRIANGLE ? -1 : 0);
+	const __m128i common = _mm_set1_epi16(common_value);
+
+	for (size_t i = first; i < first + count; i += 8)
+	{
+		__m128i value = common;
+
+		if (!shared)
+		{
+			value = _mm_load_si128((const __m128i*) &lfo->value[i]);
+			__m128i status = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &lfo->status[i]), zero);
+			__m128i up = _mm_cmpeq_epi16(_mm_and_si128(status, dir_bit), dir_bit);
+
+			__m128i fold_top = _mm_and_si128(up, _mm_cmpgt_epi16(value, top));
+			__m128i fold_bottom = _mm_andnot_si128(up, _mm_cmpgt_epi16(bottom, value));
+			__m128i fold = _mm_or_si128(fold_top, fold_bottom);
+
+			__m128i moved = usynth_bank_lfo_select(up, _mm_add_epi16(value, step), _mm_sub_epi16(value, step));
+			__m128i folded = _mm_sub_epi16(usynth_bank_lfo_select(up, max, min), _mm_sub_epi16(value, usynth_bank_lfo_select(up, top, bottom)));
+			value = usynth_bank_lfo_select(fold, folded, moved);
+			status = _mm_xor_si128(status, _mm_and_si128(fold, dir_bit));
+
+			_mm_storel_epi64((__m128i*) &lfo->status[i], _mm_packus_epi16(status, zero));
+			_mm_store_si128((__m128i*) &lfo->value[i], value);
+		}
+
+		__m128i fade = _mm_load_si128((const __m128i*) &lfo->fade[i]);
+		__m128i gate = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &lfo->gate[i]), zero);
+		fade = usynth_bank_lfo_select(_mm_cmpeq_epi16(gate, zero), fade, _mm_adds_epu16(fade, fade_step));
+		_mm_store_si128((__m128i*) &lfo->fade[i], fade);
+
+		__m128i tri = _mm_add_epi16(_mm_mulhi_epi16(value, fade), _mm_and_si128(_mm_srai_epi16(fade, 15), value));
+		__m128i half = _mm_srli_epi16(fade, 1);
+		__m128i square = usynth_bank_lfo_select(_mm_cmpgt_epi16(value, zero), half, _mm_sub_epi16(zero, half));
+		_mm_store_si128((__m128i*) &lfo->output[i], usynth_bank_lfo_select(triangle, tri, square));
+	}
+}
+
+#else
+
+static inline void usynth_bank_lfo_update(usynth_bank_lfo *lfo, size_t first, size_t count, uint8_t shared, int16_t value)
+{
+	if (!shared)
+	{
+		usynth_bank_lfo_update_scalar(lfo, first, count);
+		return;
+	}
+
+	// The fade and waveform part of usynth_lfo_update()
+	for (size_t i = first; i < first + count; i++)
+	{
+		if (lfo->gate[i])
+		{
+			uint16_t tmp = lfo->fade[i] + lfo->fade_step;
+			lfo->fade[i] = tmp < lfo->fade[i] ? UINT16_MAX : tmp;
+		}
+
+		if (lfo->waveform == USYNTH_LFO_TRIANGLE)
+			MUL_S16_U16_16H(lfo->output[i], value, lfo->fade[i]);
+		else
+			lfo->output[i] = value > 0 ? (lfo->fade[i] >> 1) : -(lfo->fade[i] >> 1);
+	}
+}
+
+#endif
+
+#endif
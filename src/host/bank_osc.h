@@ -0,0 +1,179 @@
+#ifndef BANK_OSC_H
+#define BANK_OSC_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "bank.h"
+#include "../mul.h"
+#include "../ppg/ppg.h"
+
+#if !defined(USYNTH_BANK_SCALAR) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
+
+/**
+	\file Voice bank oscillator kernels
+
+	Render one lane group of oscillators, scaled by the amplitude EG and
+	velocity, and add them to the mix - the per-voice part of usynth_sample().
+	The AVX2 and SSE2 kernels produce exactly the same sums as the scalar
+	one. USYNTH_BANK_SCALAR forces the scalar kernel.
+
+	The SIMD kernels do the math in 16-bit lanes:
+	 - the 7-bit phase is phase >> 9, mirroring the first half of the
+	   cycle is j ^ 63 and 255 - s is s ^ 255 - both applied with masks
+	 - (256 - f) * l and f * r both fit in 16 bits
+	 - MUL_U16_U16_16H() is mulhi_epu16 and MUL_U16_U8_16H(x, v) is
+	   mulhi_epu16(x, v << 8)
+*/
+
+//! Scalar reference kernel - one voice at a time
+static inline void usynth_bank_osc_render_scalar(usynth_bank *bank, size_t first, uint32_t (*mix)[USYNTH_BANK_MIX_WIDTH], uint8_t n)
+{
+	for (size_t i = first; i < first + USYNTH_BANK_LANES; i++)
+	{
+		const uint8_t *ptr_l = ppg_get_waveform_pointer(bank->osc.wave_l[i]);
+		const uint8_t *ptr_r = ppg_get_waveform_pointer(bank->osc.wave_r[i]);
+		uint8_t factor = bank->osc.factor[i];
+		uint16_t phase = bank->osc.phase[i];
+		uint16_t step = bank->osc.phase_step[i];
+		uint16_t amp = bank->amp_eg.output[i];
+		uint8_t velocity = bank->velocity[i] << 1;
+
+		for (uint8_t t = 0; t < n; t++)
+		{
+			uint16_t x;
+			phase += step;
+			MUL_U16_U16_16H(x, ppg_get_wavetable_sample(ptr_l, ptr_r, factor, phase), amp);
+			MUL_U16_U8_16H(x, x, velocity);
+			mix[t][0] += x;
+		}
+
+		bank->osc.phase[i] = phase;
+	}
+}
+
+#if !defined(USYNTH_BANK_SCALAR) && defined(__AVX2__)
+
+//! Reads 16 waveform samples - index is wave * 64 + sample
+static inline __m256i usynth_bank_osc_gather(const uint32_t *waveforms, __m256i index)
+{
+	__m256i lo = _mm256_i32gather_epi32((const int*) waveforms, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(index)), 4);
+	__m256i hi = _mm256_i32gather_epi32((const int*) waveforms, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(index, 1)), 4);
+
+	// packus works within 128-bit halves
+	return _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+}
+
+//! AVX2 kernel - all 16 lanes at once
+static inline void usynth_bank_osc_render(usynth_bank *bank, size_t first, uint32_t (*mix)[USYNTH_BANK_MIX_WIDTH], uint8_t n)
+{
+	const __m256i c63 = _mm256_set1_epi16(63);
+	const __m256i c64 = _mm256_set1_epi16(64);
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i c256 = _mm256_set1_epi16(256);
+	const __m256i zero = _mm256_setzero_si256();
+
+	__m256i phase = _mm256_load_si256((const __m256i*) &bank->osc.phase[first]);
+	__m256i step = _mm256_load_si256((const __m256i*) &bank->osc.phase_step[first]);
+	__m256i amp = _mm256_load_si256((const __m256i*) &bank->amp_eg.output[first]);
+	__m256i base_l = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &bank->osc.wave_l[first])), 6);
+	__m256i base_r = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &bank->osc.wave_r[first])), 6);
+	__m256i factor_r = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &bank->osc.factor[first]));
+	__m256i factor_l = _mm256_sub_epi16(c256, factor_r);
+	__m256i velocity = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*) &bank->velocity[first])), 9);
+
+	for (uint8_t t = 0; t < n; t++)
+	{
+		phase = _mm256_add_epi16(phase, step);
+
+		// All ones in the second half of the cycle
+		__m256i p = _mm256_srli_epi16(phase, 9);
+		__m256i half = _mm256_cmpeq_epi16(_mm256_and_si256(p, c64), c64);
+		__m256i j = _mm256_xor_si256(_mm256_and_si256(p, c63), _mm256_andnot_si256(half, c63));
+		__m256i flip = _mm256_andnot_si256(half, c255);
+
+		__m256i l = _mm256_xor_si256(usynth_bank_osc_gather(bank->waveforms, _mm256_add_epi16(base_l, j)), flip);
+		__m256i r = _mm256_xor_si256(usynth_bank_osc_gather(bank->waveforms, _mm256_add_epi16(base_r, j)), flip);
+		__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(factor_l, l), _mm256_mullo_epi16(factor_r, r));
+
+		x = _mm256_mulhi_epu16(x, amp);
+		x = _mm256_mulhi_epu16(x, velocity);
+
+		__m256i sum = _mm256_add_epi32(_mm256_unpacklo_epi16(x, zero), _mm256_unpackhi_epi16(x, zero));
+		__m256i *m = (__m256i*) mix[t];
+		_mm256_store_si256(m, _mm256_add_epi32(_mm256_load_si256(m), sum));
+	}
+
+	_mm256_store_si256((__m256i*) &bank->osc.phase[first], phase);
+}
+
+#elif !defined(USYNTH_BANK_SCALAR) && defined(__SSE2__)
+
+//! SSE2 kernel - 8 lanes at once, waveform reads are scalar
+static inline void usynth_bank_osc_render(usynth_bank *bank, size_t first, uint32_t (*mix)[USYNTH_BANK_MIX_WIDTH], uint8_t n)
+{
+	const __m128i c63 = _mm_set1_epi16(63);
+	const __m128i c64 = _mm_set1_epi16(64);
+	const __m128i c255 = _mm_set1_epi16(255);
+	const __m128i c256 = _mm_set1_epi16(256);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (size_t i = first; i < first + USYNTH_BANK_LANES; i += 8)
+	{
+		__m128i phase = _mm_load_si128((const __m128i*) &bank->osc.phase[i]);
+		__m128i step = _mm_load_si128((const __m128i*) &bank->osc.phase_step[i]);
+		__m128i amp = _mm_load_si128((const __m128i*) &bank->amp_eg.output[i]);
+		__m128i base_l = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &bank->osc.wave_l[i]), zero), 6);
+		__m128i base_r = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &bank->osc.wave_r[i]), zero), 6);
+		__m128i factor_r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &bank->osc.factor[i]), zero);
+		__m128i factor_l = _mm_sub_epi16(c256, factor_r);
+		__m128i velocity = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) &bank->velocity[i]), zero), 9);
+
+		for (uint8_t t = 0; t < n; t++)
+		{
+			phase = _mm_add_epi16(phase, step);
+
+			__m128i p = _mm_srli_epi16(phase, 9);
+			__m128i half = _mm_cmpeq_epi16(_mm_and_si128(p, c64), c64);
+			__m128i j = _mm_xor_si128(_mm_and_si128(p, c63), _mm_andnot_si128(half, c63));
+			__m128i flip = _mm_andnot_si128(half, c255);
+
+			uint16_t index_l[8] __attribute__((aligned(16)));
+			uint16_t index_r[8] __attribute__((aligned(16)));
+			_mm_store_si128((__m128i*) index_l, _mm_add_epi16(base_l, j));
+			_mm_store_si128((__m128i*) index_r, _mm_add_epi16(base_r, j));
+
+			__m128i l = _mm_setr_epi16(
+				bank->waveforms[index_l[0]], bank->waveforms[index_l[1]], bank->waveforms[index_l[2]], bank->waveforms[index_l[3]],
+				bank->waveforms[index_l[4]], bank->waveforms[index_l[5]], bank->waveforms[index_l[6]], bank->waveforms[index_l[7]]);
+			__m128i r = _mm_setr_epi16(
+				bank->waveforms[index_r[0]], bank->waveforms[index_r[1]], bank->waveforms[index_r[2]], bank->waveforms[index_r[3]],
+				bank->waveforms[index_r[4]], bank->waveforms[index_r[5]], bank->waveforms[index_r[6]], bank->waveforms[index_r[7]]);
+
+			l = _mm_xor_si128(l, flip);
+			r = _mm_xor_si128(r, flip);
+			__m128i x = _mm_add_epi16(_mm_mullo_epi16(factor_l, l), _mm_mullo_epi16(factor_r, r));
+
+			x = _mm_mulhi_epu16(x, amp);
+			x = _mm_mulhi_epu16(x, velocity);
+
+			__m128i sum = _mm_add_epi32(_mm_unpacklo_epi16(x, zero), _mm_unpackhi_epi16(x, zero));
+			__m128i *m = (__m128i*) mix[t];
+			_mm_store_si128(m, _mm_add_epi32(_mm_load_si128(m), sum));
+		}
+
+		_mm_store_si128((__m128i*) &bank->osc.phase[i], phase);
+	}
+}
+
+#else
+
+static inline void usynth_bank_osc_render(usynth_bank *bank, size_t first, uint32_t (*mix)[USYNTH_BANK_MIX_WIDTH], uint8_t n)
+{
+	usynth_bank_osc_render_scalar(bank, first, mix, n);
+}
+
+#endif
+
+#endif
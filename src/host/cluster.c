@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include "cluster.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../midi_cc.h"
+
+//! Renders samples until the given sample number, waits for space in the output ring
+static void cluster_node_render(usynth_cluster_node *node, uint64_t end)
+{
+	uint64_t samples = atomic_load_explicit(&node->samples, memory_order_relaxed);
+
+	while (samples < end && !atomic_load_explicit(&node->cluster->quit, memory_order_relaxed))
+	{
+		uint64_t space = USYNTH_CLUSTER_OUTPUT - (samples - atomic_load_explicit(&node->mixed, memory_order_acquire));
+		if (!space)
+		{
+			sched_yield();
+			continue;
+		}
+
+		size_t pos = samples % USYNTH_CLUSTER_OUTPUT;
+		uint64_t n = end - samples;
+		if (n > space) n = space;
+		if (n > USYNTH_CLUSTER_OUTPUT - pos) n = USYNTH_CLUSTER_OUTPUT - pos;
+
+		usynth_render(&node->synth, &node->output[pos], n);
+		samples += n;
+		atomic_store_explicit(&node->samples, samples, memory_order_release);
+	}
+}
+
+//! Same as render_midi_put() in usynth-render - waits for room, so nothing is dropped
+static void cluster_node_midi_put(usynth_cluster_node *node, uint8_t byte)
+{
+	while (usynth_midi_space(&node->synth) < USYNTH_HEALTH_MSG_MAX
+		&& !atomic_load_explicit(&node->cluster->quit, memory_order_relaxed))
+		cluster_node_render(node, atomic_load_explicit(&node->samples, memory_order_relaxed) + USYNTH_CONTROL_SLOTS);
+
+	usynth_midi_put(&node->synth, byte);
+}
+
+static void *cluster_node_thread(void *arg)
+{
+	usynth_cluster_node *node = arg;
+	size_t rcnt = 0;
+
+	while (!atomic_load_explicit(&node->cluster->quit, memory_order_relaxed))
+	{
+		if (rcnt == atomic_load_explicit(&node->event_wcnt, memory_order_acquire))
+		{
+			sched_yield();
+			continue;
+		}
+
+		usynth_cluster_event ev = node->events[rcnt % USYNTH_CLUSTER_EVENTS];
+		if (ev.end)
+		{
+			cluster_node_render(node, atomic_load_explicit(&node->samples, memory_order_relaxed) + ev.time);
+			break;
+		}
+
+		cluster_node_render(node, ev.time);
+		cluster_node_midi_put(node, ev.byte);
+		atomic_store_explicit(&node->event_rcnt, ++rcnt, memory_order_release);
+	}
+
+	atomic_store_explicit(&node->done, 1, memory_order_release);
+	return NULL;
+}
+
+/**
+	Passes samples rendered by all nodes to the output
+
+	\returns number of mixed samples
+*/
+static size_t cluster_mix(usynth_cluster *cluster)
+{
+	uint64_t end = UINT64_MAX;
+	for (unsigned i = 0; i < cluster->size; i++)
+	{
+		uint64_t samples = atomic_load_explicit(&cluster->nodes[i]->samples, memory_order_acquire);
+		if (samples < end) end = samples;
+	}
+
+	size_t total = 0;
+	while (cluster->mixed < end)
+	{
+		size_t pos = cluster->mixed % USYNTH_CLUSTER_OUTPUT;
+		size_t n = end - cluster->mixed;
+		if (n > USYNTH_CLUSTER_OUTPUT - pos) n = USYNTH_CLUSTER_OUTPUT - pos;
+
+		// Average of the nodes, like a passive mixer
+		for (size_t j = 0; j < n; j++)
+		{
+			int32_t sum = 0;
+			for (unsigned i = 0; i < cluster->size; i++)
+				sum += cluster->nodes[i]->output[pos + j];
+			cluster->mix[j] = sum / (int32_t) cluster->size;
+		}
+
+		cluster->mixed += n;
+		for (unsigned i = 0; i < cluster->size; i++)
+			atomic_store_explicit(&cluster->nodes[i]->mixed, cluster->mixed, memory_order_release);
+
+		cluster->output(cluster->output_ctx, cluster->mix, n);
+		total += n;
+	}
+
+	return total;
+}
+
+//! Appends an event to the node's queue - mixes while waiting for space
+static void cluster_send(usynth_cluster *cluster, usynth_cluster_node *node, usynth_cluster_event ev)
+{
+	size_t wcnt = atomic_load_explicit(&node->event_wcnt, memory_order_relaxed);
+
+	while (wcnt - atomic_load_explicit(&node->event_rcnt, memory_order_acquire) == USYNTH_CLUSTER_EVENTS)
+		if (!cluster_mix(cluster))
+			sched_yield();
+
+	node->events[wcnt % USYNTH_CLUSTER_EVENTS] = ev;
+	atomic_store_explicit(&node->event_wcnt, wcnt + 1, memory_order_release);
+}
+
+//! Sends each node its own cluster size and ID
+static void cluster_configure(usynth_cluster *cluster, uint64_t time)
+{
+	if (cluster->size == 1)
+		return;
+
+	for (unsigned i = 0; i < cluster->size; i++)
+	{
+		const uint8_t config[] = {
+			0xb0, MIDI_CLUSTER_SIZE, cluster->size,
+			MIDI_CLUSTER_ID, i,
+			cluster->midi_status, // Restores running status
+		};
+
+		for (size_t j = 0; j < sizeof(config) - !cluster->midi_status; j++)
+			cluster_send(cluster, cluster->nodes[i], (usynth_cluster_event){.time = time, .byte = config[j]});
+	}
+}
+
+//! Returns the n-th (modulo their count) CPU from the set or -1 if it's empty
+static int cluster_cpu(const cpu_set_t *set, unsigned n)
+{
+	int count = CPU_COUNT(set);
+	if (!count)
+		return -1;
+
+	n %= count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, set) && n-- == 0)
+			return cpu;
+	return -1;
+}
+
+/**
+	Sets up the nodes and starts their threads. Node i is pinned
+	to the i-th CPU the process may run on (modulo their count).
+
+	\returns 0 on success
+*/
+int usynth_cluster_init(usynth_cluster *cluster, unsigned size, usynth_cluster_output output, void *ctx)
+{
+	memset(cluster, 0, sizeof(*cluster));
+	if (size < 1 || size > USYNTH_CLUSTER_MAX_NODES)
+		return -1;
+
+	cluster->size = size;
+	cluster->output = output;
+	cluster->output_ctx = ctx;
+	atomic_init(&cluster->quit, 0);
+
+	cluster->nodes = calloc(size, sizeof(usynth_cluster_node*));
+	if (!cluster->nodes)
+		return -1;
+
+	// All nodes are initialized here, so the wave cache is built only once
+	for (unsigned i = 0; i < size; i++)
+	{
+		usynth_cluster_node *node = aligned_alloc(64, sizeof(usynth_cluster_node));
+		cluster->nodes[i] = node;
+		if (!node)
+		{
+			usynth_cluster_free(cluster);
+			return -1;
+		}
+
+		memset(node, 0, sizeof(*node));
+		usynth_init(&node->synth);
+		node->cluster = cluster;
+		node->id = i;
+		atomic_init(&node->event_rcnt, 0);
+		atomic_init(&node->event_wcnt, 0);
+		atomic_init(&node->samples, 0);
+		atomic_init(&node->mixed, 0);
+		atomic_init(&node->done, 0);
+	}
+
+	cluster_configure(cluster, 0);
+
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		CPU_ZERO(&allowed);
+
+	for (unsigned i = 0; i < size; i++)
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+
+		int cpu = cluster_cpu(&allowed, i);
+		if (cpu >= 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+
+		int err = pthread_create(&cluster->nodes[i]->thread, &attr, cluster_node_thread, cluster->nodes[i]);
+		pthread_attr_destroy(&attr);
+		if (err)
+		{
+			usynth_cluster_free(cluster);
+			return -1;
+		}
+
+		cluster->started++;
+	}
+
+	return 0;
+}
+
+//! Stops the nodes without waiting for the output
+void usynth_cluster_free(usynth_cluster *cluster)
+{
+	atomic_store(&cluster->quit, 1);
+	for (unsigned i = 0; i < cluster->started; i++)
+		pthread_join(cluster->nodes[i]->thread, NULL);
+	cluster->started = 0;
+
+	if (cluster->nodes)
+		for (unsigned i = 0; i < cluster->size; i++)
+			free(cluster->nodes[i]);
+	free(cluster->nodes);
+	cluster->nodes = NULL;
+}
+
+/**
+	Sends a MIDI byte to all nodes - it becomes available to them at
+	given sample time. Times must not decrease.
+*/
+void usynth_cluster_midi(usynth_cluster *cluster, uint64_t time, uint8_t byte)
+{
+	for (unsigned i = 0; i < cluster->size; i++)
+		cluster_send(cluster, cluster->nodes[i], (usynth_cluster_event){.time = time, .byte = byte});
+
+	// Running status, as usynth_midi_put() tracks it - only channel messages
+	// set it, SysEx and system common clear it, real-time bytes leave it
+	if (byte < 0x80)
+	{
+		if (cluster->midi_status == 0xc0)
+			cluster_configure(cluster, time);
+	}
+	else if (byte < 0xf0)
+		cluster->midi_status = byte;
+	else if (byte < 0xf8)
+		cluster->midi_status = 0;
+
+	cluster_mix(cluster);
+}
+
+//! Renders given number of samples after the last MIDI byte, mixes everything and stops the nodes
+void usynth_cluster_finish(usynth_cluster *cluster, uint64_t tail)
+{
+	for (unsigned i = 0; i < cluster->size; i++)
+		cluster_send(cluster, cluster->nodes[i], (usynth_cluster_event){.time = tail, .end = 1});
+
+	for (unsigned i = 0; i < cluster->size; i++)
+		while (!atomic_load_explicit(&cluster->nodes[i]->done, memory_order_acquire))
+			if (!cluster_mix(cluster))
+				sched_yield();
+	cluster_mix(cluster);
+
+	for (unsigned i = 0; i < cluster->started; i++)
+		pthread_join(cluster->nodes[i]->thread, NULL);
+	cluster->started = 0;
+}
@@ -0,0 +1,95 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "../usynth.h"
+
+/**
+	\file Cluster simulator - several chips playing one MIDI stream
+
+	Each node is a complete usynth_instance running in its own thread,
+	pinned to its own core if there are enough of them. All nodes get the
+	same MIDI bytes at the same sample times, so they run in lockstep like
+	chips clocked from one crystal, and the firmware's cluster logic
+	(MIDI_CLUSTER_SIZE, MIDI_CLUSTER_ID, update_global_2()) decides which
+	voices each of them plays. The outputs are mixed sample by sample.
+
+	Every node has two single-producer single-consumer rings:
+	 - MIDI events, written by the thread calling usynth_cluster_midi()
+	 - output samples, read by the same thread when mixing
+	A node renders up to the time of its next event, so it never gets
+	ahead of the MIDI stream.
+
+	Cluster size and ID are per-board settings, but every preset sets them
+	too (to 1 and 0). The simulator therefore sends each node its own
+	MIDI_CLUSTER_SIZE and MIDI_CLUSTER_ID at the start and after each
+	program change on channel 0, as a controller configuring the boards
+	would. A cluster of one node gets nothing extra and renders exactly
+	what a single usynth_instance does.
+*/
+
+//! Largest cluster the firmware supports
+#define USYNTH_CLUSTER_MAX_NODES (MIDI_MAX_VOICES / USYNTH_VOICES)
+
+//! Size of the MIDI event ring of each node (power of two)
+#define USYNTH_CLUSTER_EVENTS 1024
+
+//! Size of the output ring of each node in samples (power of two)
+#define USYNTH_CLUSTER_OUTPUT 8192
+
+//! Receives the mixed output - called from the thread feeding MIDI
+typedef void (*usynth_cluster_output)(void *ctx, int16_t *data, size_t frames);
+
+//! MIDI byte becoming available to a node at given sample time
+typedef struct usynth_cluster_event
+{
+	uint64_t time;
+	uint8_t byte;
+	uint8_t end; //!< Render time more samples and stop
+} usynth_cluster_event;
+
+typedef struct usynth_cluster usynth_cluster;
+
+typedef struct usynth_cluster_node
+{
+	usynth_instance synth;
+	usynth_cluster *cluster;
+	unsigned id;
+	pthread_t thread;
+
+	// MIDI events - node reads, feeding thread writes
+	usynth_cluster_event events[USYNTH_CLUSTER_EVENTS];
+	_Alignas(64) atomic_size_t event_rcnt;
+	_Alignas(64) atomic_size_t event_wcnt;
+
+	// Output - node writes, feeding thread reads
+	int16_t output[USYNTH_CLUSTER_OUTPUT];
+	_Alignas(64) atomic_uint_fast64_t samples;
+	_Alignas(64) atomic_uint_fast64_t mixed;
+	atomic_int done;
+} usynth_cluster_node;
+
+struct usynth_cluster
+{
+	unsigned size;
+	usynth_cluster_node **nodes;
+	unsigned started;           //!< Number of running node threads
+	atomic_int quit;
+
+	usynth_cluster_output output;
+	void *output_ctx;
+	uint64_t mixed;             //!< Samples passed to output
+	int16_t mix[USYNTH_CLUSTER_OUTPUT];
+
+	uint8_t midi_status;        //!< Running status of the stream sent (0 if none)
+};
+
+extern int usynth_cluster_init(usynth_cluster *cluster, unsigned size, usynth_cluster_output output, void *ctx);
+extern void usynth_cluster_free(usynth_cluster *cluster);
+extern void usynth_cluster_midi(usynth_cluster *cluster, uint64_t time, uint8_t byte);
+extern void usynth_cluster_finish(usynth_cluster *cluster, uint64_t tail);
+
+#endif
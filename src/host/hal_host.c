@@ -0,0 +1,36 @@
+#include "hal_host.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include "../hal.h"
+
+static hal_host_midi_tx_handler midi_tx_handler = NULL;
+static void *midi_tx_ctx = NULL;
+
+//! Each thread running a synth (e.g. a cluster node) has its own LEDs
+static _Thread_local uint8_t leds = 0;
+
+void hal_host_set_midi_tx_handler(hal_host_midi_tx_handler handler, void *ctx)
+{
+	midi_tx_handler = handler;
+	midi_tx_ctx = ctx;
+}
+
+//! Returns LED states as they would appear on PORTD
+uint8_t hal_host_get_leds(void)
+{
+	return leds;
+}
+
+void hal_led_write(uint8_t pin, uint8_t on)
+{
+	if (on)
+		leds |= (1 << pin);
+	else
+		leds &= ~(1 << pin);
+}
+
+void hal_midi_tx(uint8_t byte)
+{
+	if (midi_tx_handler)
+		midi_tx_handler(midi_tx_ctx, byte);
+}
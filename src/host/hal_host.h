@@ -0,0 +1,15 @@
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include <inttypes.h>
+
+/**
+	Receives bytes the synth transmits over its MIDI TX line
+	(e.g. ping replies)
+*/
+typedef void (*hal_host_midi_tx_handler)(void *ctx, uint8_t byte);
+
+extern void hal_host_set_midi_tx_handler(hal_host_midi_tx_handler handler, void *ctx);
+extern uint8_t hal_host_get_leds(void);
+
+#endif
@@ -0,0 +1,141 @@
+#include "pool.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+//! Runs tasks until all queues are empty
+static void pool_work(usynth_pool *pool, unsigned worker)
+{
+	// Own queue first, then steal from the others
+	for (unsigned k = 0; k < pool->size; k++)
+	{
+		usynth_pool_queue *q = &pool->queues[(worker + k) % pool->size];
+		size_t task;
+		while ((task = atomic_fetch_add(&q->next, 1)) < q->end)
+			pool->func(pool->arg, task, worker);
+	}
+}
+
+typedef struct pool_thread_arg
+{
+	usynth_pool *pool;
+	unsigned worker;
+} pool_thread_arg;
+
+static void *pool_thread(void *arg)
+{
+	pool_thread_arg a = *(pool_thread_arg*) arg;
+	usynth_pool *pool = a.pool;
+	free(arg);
+
+	unsigned generation = 0;
+	while (1)
+	{
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == generation && !pool->quit)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		generation = pool->generation;
+		int quit = pool->quit;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (quit)
+			return NULL;
+
+		pool_work(pool, a.worker);
+		atomic_fetch_sub(&pool->busy, 1);
+	}
+}
+
+/**
+	Starts size - 1 threads
+
+	\returns 0 on success
+*/
+int usynth_pool_init(usynth_pool *pool, unsigned size)
+{
+	pool->size = size ? size : 1;
+	pool->generation = 0;
+	pool->quit = 0;
+	atomic_init(&pool->busy, 0);
+	pool->threads = calloc(pool->size, sizeof(pthread_t));
+	pool->queues = aligned_alloc(64, pool->size * sizeof(usynth_pool_queue));
+	if (!pool->threads || !pool->queues)
+	{
+		free(pool->threads);
+		free(pool->queues);
+		return -1;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+
+	for (unsigned i = 1; i < pool->size; i++)
+	{
+		pool_thread_arg *arg = malloc(sizeof(pool_thread_arg));
+		if (arg)
+			*arg = (pool_thread_arg){.pool = pool, .worker = i};
+
+		if (!arg || pthread_create(&pool->threads[i], NULL, pool_thread, arg))
+		{
+			free(arg);
+			pool->size = i;
+			usynth_pool_free(pool);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+//! Stops all threads
+void usynth_pool_free(usynth_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned i = 1; i < pool->size; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	free(pool->threads);
+	free(pool->queues);
+	pool->threads = NULL;
+	pool->queues = NULL;
+}
+
+//! Runs func for tasks 0 .. count - 1 and waits until all of them are done
+void usynth_pool_run(usynth_pool *pool, usynth_pool_func func, void *arg, size_t count)
+{
+	if (pool->size == 1 || count < 2)
+	{
+		for (size_t i = 0; i < count; i++)
+			func(arg, i, 0);
+		return;
+	}
+
+	for (unsigned w = 0; w < pool->size; w++)
+	{
+		atomic_store(&pool->queues[w].next, count * w / pool->size);
+		pool->queues[w].end = count * (w + 1) / pool->size;
+	}
+
+	pool->func = func;
+	pool->arg = arg;
+	atomic_store(&pool->busy, pool->size - 1);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_work(pool, 0);
+
+	// The others may still be finishing their last tasks
+	while (atomic_load(&pool->busy))
+		sched_yield();
+}
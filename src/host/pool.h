@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+	\file Work-stealing thread pool
+
+	usynth_pool_run() splits tasks 0 .. count - 1 into equal contiguous
+	ranges, one per worker. Each worker takes tasks from the front of its
+	own range and, when that's empty, from the ranges of the others. The
+	calling thread is worker 0.
+*/
+
+//! Runs one task - worker is the index of the thread running it
+typedef void (*usynth_pool_func)(void *arg, size_t task, unsigned worker);
+
+//! Range of tasks assigned to a worker
+typedef struct usynth_pool_queue
+{
+	atomic_size_t next;
+	size_t end;
+} __attribute__((aligned(64))) usynth_pool_queue;
+
+typedef struct usynth_pool
+{
+	unsigned size;              //!< Number of workers, including the calling thread
+	pthread_t *threads;
+	usynth_pool_queue *queues;
+
+	// Workers wait for the next run
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	unsigned generation;
+	int quit;
+
+	usynth_pool_func func;
+	void *arg;
+	atomic_uint busy;           //!< Workers that haven't finished the current run
+} usynth_pool;
+
+extern int usynth_pool_init(usynth_pool *pool, unsigned size);
+extern void usynth_pool_free(usynth_pool *pool);
+extern void usynth_pool_run(usynth_pool *pool, usynth_pool_func func, void *arg, size_t count);
+
+#endif
@@ -0,0 +1,128 @@
+#include "sim.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libelf.h>
+#include <gelf.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <avr_uart.h>
+
+/**
+	Loads firmware into a new simulated ATmega328P running at F_CPU
+
+	UART output is not echoed to stdout
+*/
+avr_t *sim_load(const char *elf, uint32_t *flash_size)
+{
+	elf_firmware_t fw = {{0}};
+	if (elf_read_firmware(elf, &fw))
+	{
+		fprintf(stderr, "%s: cannot load firmware\n", elf);
+		return NULL;
+	}
+
+	avr_t *avr = avr_make_mcu_by_name("atmega328p");
+	if (!avr)
+	{
+		fprintf(stderr, "simavr has no ATmega328P support\n");
+		return NULL;
+	}
+
+	avr_init(avr);
+	avr_load_firmware(avr, &fw);
+	avr->frequency = F_CPU;
+	if (flash_size)
+		*flash_size = fw.flashsize;
+
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+	return avr;
+}
+
+/**
+	Replaces I/O write handler installed by a simulated peripheral.
+	The hook is responsible for calling the original one.
+*/
+int sim_hook_write(avr_t *avr, uint16_t addr, avr_io_write_t fn, sim_io_hook *orig)
+{
+	orig->write = avr->io[AVR_DATA_TO_IO(addr)].w.c;
+	orig->param = avr->io[AVR_DATA_TO_IO(addr)].w.param;
+	if (!orig->write)
+	{
+		fprintf(stderr, "no I/O write handler at 0x%02x\n", addr);
+		return -1;
+	}
+
+	avr->io[AVR_DATA_TO_IO(addr)].w.c = fn;
+	return 0;
+}
+
+//! \see sim_hook_write()
+int sim_hook_read(avr_t *avr, uint16_t addr, avr_io_read_t fn, sim_io_hook *orig)
+{
+	orig->read = avr->io[AVR_DATA_TO_IO(addr)].r.c;
+	orig->param = avr->io[AVR_DATA_TO_IO(addr)].r.param;
+	if (!orig->read)
+	{
+		fprintf(stderr, "no I/O read handler at 0x%02x\n", addr);
+		return -1;
+	}
+
+	avr->io[AVR_DATA_TO_IO(addr)].r.c = fn;
+	return 0;
+}
+
+/**
+	Looks up a symbol in the ELF symbol table. Local symbols renamed
+	by LTO (e.g. 'dac_sent.lto_priv.0') match too.
+
+	\returns 0 on success
+*/
+int sim_find_symbol(const char *elf, const char *name, uint32_t *value)
+{
+	if (elf_version(EV_CURRENT) == EV_NONE)
+		return -1;
+
+	int fd = open(elf, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	Elf *e = elf_begin(fd, ELF_C_READ, NULL);
+	Elf_Scn *scn = NULL;
+	size_t name_length = strlen(name);
+	int found = 0;
+
+	while (e && !found && (scn = elf_nextscn(e, scn)))
+	{
+		GElf_Shdr shdr;
+		if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != SHT_SYMTAB || !shdr.sh_entsize)
+			continue;
+
+		Elf_Data *data = elf_getdata(scn, NULL);
+		for (size_t i = 0; data && i < shdr.sh_size / shdr.sh_entsize; i++)
+		{
+			GElf_Sym sym;
+			if (!gelf_getsym(data, i, &sym))
+				continue;
+
+			const char *s = elf_strptr(e, shdr.sh_link, sym.st_name);
+			if (s && !strncmp(s, name, name_length) && (s[name_length] == '\0' || s[name_length] == '.'))
+			{
+				*value = sym.st_value;
+				found = 1;
+				break;
+			}
+		}
+	}
+
+	if (e) elf_end(e);
+	close(fd);
+	return found ? 0 : -1;
+}
@@ -0,0 +1,38 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <inttypes.h>
+#include <sim_avr.h>
+
+/**
+	\file simavr helpers shared by the simulator based tools
+*/
+
+// ATmega328P data space addresses
+#define SIM_PORTD 0x2b
+#define SIM_SPDR  0x4e
+#define SIM_UDR0  0xc6
+
+//! 'cbi PORTD, LED_GRN_PIN' ends the wait for dac_sent in every main loop iteration
+#define SIM_CBI_GRN_LED (0x9800 | ((SIM_PORTD - 0x20) << 3) | LED_GRN_PIN)
+
+//! Original I/O handler replaced by a hook
+typedef struct sim_io_hook
+{
+	avr_io_read_t read;
+	avr_io_write_t write;
+	void *param;
+} sim_io_hook;
+
+extern avr_t *sim_load(const char *elf, uint32_t *flash_size);
+extern int sim_hook_write(avr_t *avr, uint16_t addr, avr_io_write_t fn, sim_io_hook *orig);
+extern int sim_hook_read(avr_t *avr, uint16_t addr, avr_io_read_t fn, sim_io_hook *orig);
+extern int sim_find_symbol(const char *elf, const char *name, uint32_t *value);
+
+//! Returns the instruction word at given flash byte address
+static inline uint16_t sim_opcode(const avr_t *avr, uint32_t pc)
+{
+	return avr->flash[pc] | (avr->flash[pc + 1] << 8);
+}
+
+#endif
@@ -0,0 +1,310 @@
+#include "smf.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+	\file Standard MIDI File reader
+
+	Only channel messages and tempo changes are of interest here.
+	SysEx and all the other meta events are skipped.
+*/
+
+//! Event read from a track, timed in ticks
+typedef struct smf_raw_event
+{
+	uint32_t tick;
+	uint16_t track;
+	uint32_t seq;
+	uint32_t tempo; //!< Non-zero for tempo changes
+	smf_event event;
+} smf_raw_event;
+
+//! Simple cursor over the file contents
+typedef struct smf_reader
+{
+	const uint8_t *data;
+	size_t pos;
+	size_t end;
+	int error;
+} smf_reader;
+
+static uint8_t smf_read_u8(smf_reader *r)
+{
+	if (r->pos >= r->end)
+	{
+		r->error = 1;
+		return 0;
+	}
+
+	return r->data[r->pos++];
+}
+
+static uint32_t smf_read_be(smf_reader *r, uint8_t bytes)
+{
+	uint32_t x = 0;
+	while (bytes--)
+		x = (x << 8) | smf_read_u8(r);
+	return x;
+}
+
+//! Reads a variable length quantity
+static uint32_t smf_read_vlq(smf_reader *r)
+{
+	uint32_t x = 0;
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		uint8_t b = smf_read_u8(r);
+		x = (x << 7) | (b & 0x7f);
+		if (!(b & 0x80))
+			return x;
+	}
+
+	r->error = 1;
+	return x;
+}
+
+static void smf_skip(smf_reader *r, uint32_t n)
+{
+	if (n > r->end - r->pos)
+	{
+		r->error = 1;
+		r->pos = r->end;
+	}
+	else
+		r->pos += n;
+}
+
+static int smf_raw_event_compare(const void *a, const void *b)
+{
+	const smf_raw_event *ea = a, *eb = b;
+	if (ea->tick != eb->tick) return ea->tick < eb->tick ? -1 : 1;
+	if (ea->track != eb->track) return ea->track < eb->track ? -1 : 1;
+	if (ea->seq != eb->seq) return ea->seq < eb->seq ? -1 : 1;
+	return 0;
+}
+
+//! Appends an event to a growing array
+static int smf_push(smf_raw_event **events, size_t *count, size_t *capacity, const smf_raw_event *ev)
+{
+	if (*count == *capacity)
+	{
+		size_t new_capacity = *capacity ? *capacity * 2 : 1024;
+		smf_raw_event *p = realloc(*events, new_capacity * sizeof(smf_raw_event));
+		if (!p) return -1;
+		*events = p;
+		*capacity = new_capacity;
+	}
+
+	(*events)[(*count)++] = *ev;
+	return 0;
+}
+
+//! Parses one MTrk chunk
+static int smf_parse_track(smf_reader *r, uint16_t track, smf_raw_event **events, size_t *count, size_t *capacity)
+{
+	uint32_t tick = 0;
+	uint32_t seq = 0;
+	uint8_t running_status = 0;
+
+	while (r->pos < r->end && !r->error)
+	{
+		tick += smf_read_vlq(r);
+		uint8_t status = smf_read_u8(r);
+
+		smf_raw_event ev = {.tick = tick, .track = track, .seq = seq++};
+
+		if (status == 0xff)
+		{
+			// Meta event
+			uint8_t type = smf_read_u8(r);
+			uint32_t length = smf_read_vlq(r);
+
+			if (type == 0x51 && length == 3)
+			{
+				ev.tempo = smf_read_be(r, 3);
+				if (ev.tempo && smf_push(events, count, capacity, &ev)) return -1;
+			}
+			else if (type == 0x2f)
+				break;
+			else
+				smf_skip(r, length);
+		}
+		else if (status == 0xf0 || status == 0xf7)
+		{
+			// SysEx is ignored
+			smf_skip(r, smf_read_vlq(r));
+			running_status = 0;
+		}
+		else
+		{
+			// Channel message, possibly with running status
+			if (status & 0x80)
+				running_status = status;
+			else if (running_status)
+				r->pos--;
+			else
+				return -1;
+
+			uint8_t type = running_status & 0xf0;
+			ev.event.length = (type == 0xc0 || type == 0xd0) ? 2 : 3;
+			ev.event.data[0] = running_status;
+			for (uint8_t i = 1; i < ev.event.length; i++)
+				ev.event.data[i] = smf_read_u8(r) & 0x7f;
+
+			if (smf_push(events, count, capacity, &ev)) return -1;
+		}
+	}
+
+	return r->error ? -1 : 0;
+}
+
+/**
+	Loads a Standard MIDI File (format 0 or 1)
+
+	\returns 0 on success
+*/
+int smf_load(smf_file *smf, const char *path)
+{
+	smf->events = NULL;
+	smf->count = 0;
+
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+
+	// Read the whole file
+	uint8_t *data = NULL;
+	size_t size = 0, capacity = 0;
+	while (!feof(f) && !ferror(f))
+	{
+		if (size == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 65536;
+			uint8_t *p = realloc(data, capacity);
+			if (!p) break;
+			data = p;
+		}
+
+		size += fread(data + size, 1, capacity - size, f);
+	}
+
+	int read_error = ferror(f) || !feof(f);
+	fclose(f);
+	if (read_error)
+	{
+		fprintf(stderr, "%s: read error\n", path);
+		free(data);
+		return -1;
+	}
+
+	smf_reader r = {.data = data, .pos = 0, .end = size, .error = 0};
+
+	// Header chunk
+	if (size < 14 || memcmp(data, "MThd", 4))
+	{
+		fprintf(stderr, "%s: not a Standard MIDI File\n", path);
+		free(data);
+		return -1;
+	}
+
+	r.pos = 4;
+	uint32_t header_length = smf_read_be(&r, 4);
+	uint16_t format = smf_read_be(&r, 2);
+	uint16_t track_count = smf_read_be(&r, 2);
+	uint16_t division = smf_read_be(&r, 2);
+	r.pos = 8 + header_length;
+
+	if (format > 1 || division == 0)
+	{
+		fprintf(stderr, "%s: unsupported MIDI file format %d\n", path, format);
+		free(data);
+		return -1;
+	}
+
+	// Parse all tracks
+	smf_raw_event *events = NULL;
+	size_t count = 0;
+	capacity = 0;
+	for (uint16_t track = 0; track < track_count && r.pos + 8 <= size; )
+	{
+		int is_track = !memcmp(data + r.pos, "MTrk", 4);
+		r.pos += 4;
+		uint32_t length = smf_read_be(&r, 4);
+		if (length > size - r.pos)
+			length = size - r.pos;
+
+		if (is_track)
+		{
+			smf_reader tr = {.data = data, .pos = r.pos, .end = r.pos + length, .error = 0};
+			if (smf_parse_track(&tr, track, &events, &count, &capacity))
+			{
+				fprintf(stderr, "%s: malformed track %d\n", path, track);
+				free(events);
+				free(data);
+				return -1;
+			}
+
+			track++;
+		}
+
+		r.pos += length;
+	}
+
+	free(data);
+
+	// Merge the tracks and convert ticks to seconds
+	qsort(events, count, sizeof(smf_raw_event), smf_raw_event_compare);
+
+	double tick_duration;
+	if (division & 0x8000)
+	{
+		// SMPTE timing - frames per second and ticks per frame
+		int fps = -(int8_t)(division >> 8);
+		tick_duration = 1.0 / ((fps == 29 ? 29.97 : fps) * (division & 0xff));
+	}
+	else
+		tick_duration = 500000e-6 / division;
+
+	smf->events = malloc((count ? count : 1) * sizeof(smf_event));
+	if (!smf->events)
+	{
+		free(events);
+		return -1;
+	}
+
+	double time = 0;
+	uint32_t last_tick = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		time += (events[i].tick - last_tick) * tick_duration;
+		last_tick = events[i].tick;
+
+		if (events[i].tempo)
+		{
+			if (!(division & 0x8000))
+				tick_duration = events[i].tempo * 1e-6 / division;
+		}
+		else
+		{
+			smf->events[smf->count] = events[i].event;
+			smf->events[smf->count].time = time;
+			smf->count++;
+		}
+	}
+
+	free(events);
+	return 0;
+}
+
+void smf_free(smf_file *smf)
+{
+	free(smf->events);
+	smf->events = NULL;
+	smf->count = 0;
+}
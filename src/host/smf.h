@@ -0,0 +1,30 @@
+#ifndef SMF_H
+#define SMF_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/**
+	A single MIDI channel message with its absolute time
+*/
+typedef struct smf_event
+{
+	double time;
+	uint8_t data[3];
+	uint8_t length;
+} smf_event;
+
+/**
+	Standard MIDI File contents - channel messages of all tracks
+	merged into one time-ordered list
+*/
+typedef struct smf_file
+{
+	smf_event *events;
+	size_t count;
+} smf_file;
+
+extern int smf_load(smf_file *smf, const char *path);
+extern void smf_free(smf_file *smf);
+
+#endif
@@ -0,0 +1,315 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sim_avr.h>
+#include <avr_uart.h>
+
+#include "../usynth.h"
+#include "../midi_cc.h"
+#include "../ppg/ppg_data.h"
+#include "sim.h"
+
+/**
+	\file Worst-case cycle benchmark
+
+	Runs the firmware ELF in simavr and measures, for every sample period,
+	how many of the F_CPU / F_SAMPLE cycles pass between the DAC interrupt
+	and the moment the main loop starts waiting for dac_sent again. Interrupts
+	taken in the meantime (MIDI RX) are included - they delay the main loop
+	all the same.
+
+	The MIDI input is saturated at the full baud rate with a few kinds of
+	worst-case traffic, each played for CYCLES_PHASE_LENGTH samples.
+
+	The wait is found by looking for 'lds' instructions reading dac_sent
+	from the main program. In the profiling build, the headroom computation
+	reads dac_sent a few instructions before the loop - that's close enough.
+*/
+
+#ifndef F_CPU
+#error F_CPU is not defined!
+#endif
+
+#ifndef F_SAMPLE
+#error F_SAMPLE is not defined!
+#endif
+
+#ifndef MIDI_BAUD
+#define MIDI_BAUD 31250
+#endif
+
+#ifndef CYCLES_PRESET_COUNT
+#error CYCLES_PRESET_COUNT is not defined!
+#endif
+
+#define CYCLES_PERIOD ((uint32_t)(F_CPU / F_SAMPLE))
+#define CYCLES_PHASE_LENGTH (F_SAMPLE * 2)
+#define CYCLES_BIN_WIDTH 32
+#define CYCLES_BIN_COUNT ((CYCLES_PERIOD * 4) / CYCLES_BIN_WIDTH + 1)
+#define CYCLES_MAX_SPIN_PCS 16
+
+//! Worst-case MIDI traffic patterns
+typedef enum cycles_phase
+{
+	CYCLES_IDLE,
+	CYCLES_WAVETABLE,
+	CYCLES_NOTE_FLOOD,
+	CYCLES_PROGRAM_CHANGE,
+	CYCLES_MIXED,
+	CYCLES_PHASE_COUNT
+} cycles_phase;
+
+static const char *cycles_phase_names[CYCLES_PHASE_COUNT] =
+{
+	"idle",
+	"wavetable changes",
+	"note-on flood",
+	"program changes",
+	"mixed",
+};
+
+//! Results for one phase
+typedef struct cycles_stats
+{
+	uint32_t samples;
+	uint32_t max;
+	uint32_t late;
+	uint64_t sum;
+} cycles_stats;
+
+//! Simulator state and measurements
+typedef struct cycles_state
+{
+	// Flash byte addresses of the instructions reading dac_sent
+	uint32_t spin_pc[CYCLES_MAX_SPIN_PCS];
+	uint8_t spin_pc_count;
+
+	uint8_t spi_byte;
+	uint64_t isr_cycle;    //!< When the last DAC word was written
+	uint64_t period_start; //!< DAC write preceding the current iteration
+	uint8_t measured;      //!< Current iteration has already reached the wait
+	uint32_t iter;
+
+	cycles_stats phase[CYCLES_PHASE_COUNT];
+	uint32_t slot_max[USYNTH_CONTROL_SLOTS];
+	uint32_t histogram[CYCLES_BIN_COUNT];
+
+	sim_io_hook spdr;
+	sim_io_hook portd;
+} cycles_state;
+
+static cycles_state cs;
+
+static void cycles_spdr_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	// High byte is written first, right at the start of the period
+	if (!(cs.spi_byte++ & 1))
+		cs.isr_cycle = avr->cycle;
+
+	cs.spdr.write(avr, addr, v, cs.spdr.param);
+}
+
+static void cycles_portd_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	if (sim_opcode(avr, avr->pc) == SIM_CBI_GRN_LED)
+	{
+		cs.iter++;
+		cs.period_start = cs.isr_cycle;
+		cs.measured = 0;
+	}
+
+	cs.portd.write(avr, addr, v, cs.portd.param);
+}
+
+//! Finds all 'lds Rd, dac_sent' instructions
+static int cycles_find_spin(avr_t *avr, const char *elf, uint32_t flash_size)
+{
+	uint32_t addr;
+	if (sim_find_symbol(elf, "dac_sent", &addr))
+	{
+		fprintf(stderr, "%s: no dac_sent symbol\n", elf);
+		return -1;
+	}
+
+	// Data space addresses are offset by 0x800000 in AVR ELF files
+	addr &= 0xffff;
+
+	for (uint32_t pc = 0; pc + 4 <= flash_size; pc += 2)
+		if ((sim_opcode(avr, pc) & 0xfe0f) == 0x9000 && sim_opcode(avr, pc + 2) == addr
+			&& cs.spin_pc_count < CYCLES_MAX_SPIN_PCS)
+			cs.spin_pc[cs.spin_pc_count++] = pc;
+
+	if (!cs.spin_pc_count)
+	{
+		fprintf(stderr, "%s: cannot find the wait for dac_sent\n", elf);
+		return -1;
+	}
+
+	return 0;
+}
+
+//! Called when an iteration reaches the wait
+static void cycles_record(avr_t *avr, cycles_phase phase)
+{
+	uint32_t consumed = avr->cycle - cs.period_start;
+	// The first iteration runs slot 0 before any cbi is executed
+	uint8_t slot = cs.iter % USYNTH_CONTROL_SLOTS;
+
+	cycles_stats *s = &cs.phase[phase];
+	s->samples++;
+	s->sum += consumed;
+	if (consumed > s->max) s->max = consumed;
+	if (consumed > CYCLES_PERIOD) s->late++;
+
+	if (consumed > cs.slot_max[slot]) cs.slot_max[slot] = consumed;
+
+	uint32_t bin = consumed / CYCLES_BIN_WIDTH;
+	cs.histogram[bin < CYCLES_BIN_COUNT ? bin : CYCLES_BIN_COUNT - 1]++;
+}
+
+/**
+	Generates the next MIDI byte of given traffic pattern.
+	Every pattern sends complete messages without running status.
+*/
+static uint8_t cycles_next_byte(cycles_phase phase)
+{
+	static uint8_t msg[3];
+	static uint8_t len, pos;
+	static uint32_t count;
+
+	if (pos == len)
+	{
+		pos = 0;
+		count++;
+
+		if (phase == CYCLES_MIXED)
+			phase = CYCLES_WAVETABLE + count % 3;
+
+		switch (phase)
+		{
+			// Both oscillators switch wavetable with every message
+			case CYCLES_WAVETABLE:
+				msg[0] = 0xb0;
+				msg[1] = MIDI_OSC_WAVETABLE(count & 1);
+				msg[2] = (count >> 1) % PPG_WAVETABLE_COUNT;
+				len = 3;
+				break;
+
+			// Note ons all over the keyboard, never released
+			case CYCLES_NOTE_FLOOD:
+				msg[0] = 0x90;
+				msg[1] = 24 + (count * 7) % 72;
+				msg[2] = 1 + count % 127;
+				len = 3;
+				break;
+
+			case CYCLES_PROGRAM_CHANGE:
+				msg[0] = 0xc0;
+				msg[1] = count % (CYCLES_PRESET_COUNT + 1);
+				len = 2;
+				break;
+
+			default:
+				return 0xfe; // Active sensing
+		}
+	}
+
+	return msg[pos++];
+}
+
+static int cycles_run(const char *elf)
+{
+	uint32_t flash_size;
+	avr_t *avr = sim_load(elf, &flash_size);
+	if (!avr || cycles_find_spin(avr, elf, flash_size))
+		return -1;
+
+	avr_irq_t *uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+
+	if (sim_hook_write(avr, SIM_SPDR, cycles_spdr_write, &cs.spdr)
+		|| sim_hook_write(avr, SIM_PORTD, cycles_portd_write, &cs.portd))
+		return -1;
+
+	// MIDI bytes are queued at the rate the UART receives them
+	const double byte_time = 10.0 * F_SAMPLE / MIDI_BAUD;
+	uint32_t bytes_sent = 0;
+	const uint32_t length = (uint32_t) CYCLES_PHASE_LENGTH * CYCLES_PHASE_COUNT;
+
+	while (cs.iter < length)
+	{
+		cycles_phase phase = cs.iter / CYCLES_PHASE_LENGTH;
+
+		while (bytes_sent * byte_time <= cs.iter)
+		{
+			if (phase != CYCLES_IDLE)
+				avr_raise_irq(uart_in, cycles_next_byte(phase));
+			bytes_sent++;
+		}
+
+		// One instruction at a time
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed)
+		{
+			fprintf(stderr, "simulation stopped after %" PRIu32 " iterations\n", cs.iter);
+			return -1;
+		}
+
+		if (!cs.measured && cs.iter)
+			for (uint8_t i = 0; i < cs.spin_pc_count; i++)
+				if (avr->pc == cs.spin_pc[i])
+				{
+					cycles_record(avr, phase);
+					cs.measured = 1;
+					break;
+				}
+	}
+
+	return 0;
+}
+
+static void cycles_report(void)
+{
+	uint32_t max = 0;
+	uint32_t late = 0;
+
+	printf("budget: %" PRIu32 " cycles per sample\n\n", CYCLES_PERIOD);
+	printf("%-20s %8s %8s %8s %8s\n", "phase", "samples", "mean", "max", "late");
+	for (uint8_t p = 0; p < CYCLES_PHASE_COUNT; p++)
+	{
+		const cycles_stats *s = &cs.phase[p];
+		printf("%-20s %8" PRIu32 " %8.1f %8" PRIu32 " %8" PRIu32 "\n", cycles_phase_names[p],
+			s->samples, s->samples ? (double) s->sum / s->samples : 0.0, s->max, s->late);
+		if (s->max > max) max = s->max;
+		late += s->late;
+	}
+
+	printf("\nslot  max cycles\n");
+	for (uint8_t i = 0; i < USYNTH_CONTROL_SLOTS; i++)
+		printf("%4d  %10" PRIu32 "\n", i, cs.slot_max[i]);
+
+	printf("\nhistogram (%d cycles per bin)\n", CYCLES_BIN_WIDTH);
+	for (uint32_t i = 0; i < CYCLES_BIN_COUNT; i++)
+		if (cs.histogram[i])
+			printf("%5" PRIu32 "%s %10" PRIu32 "\n", i * CYCLES_BIN_WIDTH,
+				i == CYCLES_BIN_COUNT - 1 ? "+" : " ", cs.histogram[i]);
+
+	printf("\nmax: %" PRIu32 " cycles (%.1f%% of budget), headroom: %" PRId32 " cycles, late samples: %" PRIu32 "\n",
+		max, 100.0 * max / CYCLES_PERIOD, (int32_t) CYCLES_PERIOD - (int32_t) max, late);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s <firmware.elf>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (cycles_run(argv[1]))
+		return EXIT_FAILURE;
+
+	cycles_report();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sim_avr.h>
+#include <avr_uart.h>
+
+#include "../usynth.h"
+#include "sim.h"
+
+/**
+	\file Golden audio regression test
+
+	Runs the firmware ELF in simavr, captures every word the DAC interrupt
+	writes to SPDR and compares it with the host engine fed with exactly
+	the same MIDI bytes at exactly the same point of the main loop.
+
+	The main loop is tracked with two hooks:
+	 - the 'cbi PORTD, LED_GRN_PIN' executed right after the wait for
+	   dac_sent marks the end of each main loop iteration
+	 - UDR0 reads tell in which iteration each MIDI byte arrived
+
+	A byte received while iteration n was running is visible to
+	iteration n + 1 and the word sent by the interrupt is the sample
+	computed by iteration n. If iteration n is late (e.g. a wavetable
+	load in the firmware), the interrupt repeats sample n - 1 - such
+	samples are reported, but not counted as mismatches.
+*/
+
+#ifndef F_SAMPLE
+#error F_SAMPLE is not defined!
+#endif
+
+#ifndef GOLDEN_PRESET_COUNT
+#error GOLDEN_PRESET_COUNT is not defined!
+#endif
+
+// The test script
+#define GOLDEN_SEGMENT_LENGTH (F_SAMPLE * 18 / 10)
+#define GOLDEN_SEGMENT_COUNT (GOLDEN_PRESET_COUNT + 1)
+#define GOLDEN_LENGTH ((uint32_t) GOLDEN_SEGMENT_LENGTH * GOLDEN_SEGMENT_COUNT)
+#define GOLDEN_MS(x) ((uint32_t)(x) * F_SAMPLE / 1000)
+
+//! MIDI message sent at given main loop iteration
+typedef struct golden_message
+{
+	uint32_t time;
+	uint8_t data[3];
+	uint8_t length;
+} golden_message;
+
+//! Data captured from the simulator
+typedef struct golden_capture
+{
+	// Words sent to the DAC and the iteration during which they were sent
+	uint16_t *words;
+	uint32_t *word_iter;
+	uint32_t word_count;
+	uint8_t spi_byte;
+	uint8_t spi_hi;
+
+	// MIDI bytes read by the interrupt and the iteration during which they arrived
+	uint8_t *midi;
+	uint32_t *midi_iter;
+	uint32_t midi_count;
+
+	// Completed main loop iterations
+	uint32_t iter;
+
+	// Original I/O handlers
+	sim_io_hook spdr;
+	sim_io_hook portd;
+	sim_io_hook udr;
+} golden_capture;
+
+static golden_capture cap;
+
+static void golden_spdr_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	// High byte first
+	if (cap.spi_byte++ & 1)
+	{
+		cap.words[cap.word_count] = (cap.spi_hi << 8) | v;
+		cap.word_iter[cap.word_count] = cap.iter;
+		if (cap.word_count + 1 < GOLDEN_LENGTH + F_SAMPLE) cap.word_count++;
+	}
+	else
+		cap.spi_hi = v;
+
+	cap.spdr.write(avr, addr, v, cap.spdr.param);
+}
+
+static void golden_portd_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	if (sim_opcode(avr, avr->pc) == SIM_CBI_GRN_LED)
+		cap.iter++;
+
+	cap.portd.write(avr, addr, v, cap.portd.param);
+}
+
+static uint8_t golden_udr_read(avr_t *avr, avr_io_addr_t addr, void *param)
+{
+	uint8_t v = cap.udr.read(avr, addr, cap.udr.param);
+	if (cap.midi_count < GOLDEN_LENGTH)
+	{
+		cap.midi[cap.midi_count] = v;
+		cap.midi_iter[cap.midi_count] = cap.iter;
+		cap.midi_count++;
+	}
+	return v;
+}
+
+//! Builds the MIDI script - every preset is played for GOLDEN_SEGMENT_LENGTH samples
+static size_t golden_script(golden_message *msg)
+{
+	size_t n = 0;
+	for (uint8_t p = 0; p < GOLDEN_SEGMENT_COUNT; p++)
+	{
+		uint32_t t = (uint32_t) p * GOLDEN_SEGMENT_LENGTH;
+
+		#define GOLDEN_MSG(dt, len, ...) \
+			(msg[n++] = (golden_message){.time = t + GOLDEN_MS(dt), .data = {__VA_ARGS__}, .length = (len)})
+
+		// Program 0 loads just the defaults
+		GOLDEN_MSG(10,   2, 0xc0, p);
+		GOLDEN_MSG(300,  3, 0x90, 60, 100);
+		GOLDEN_MSG(350,  3, 0x90, 67, 90);
+		GOLDEN_MSG(600,  3, 0xe0, 0x00, 0x50);
+		GOLDEN_MSG(800,  3, 0xb0, 103, 40);
+		GOLDEN_MSG(1000, 3, 0x80, 60, 0);
+		GOLDEN_MSG(1050, 3, 0x80, 67, 0);
+		GOLDEN_MSG(1600, 3, 0xe0, 0x00, 0x40);
+
+		#undef GOLDEN_MSG
+	}
+
+	return n;
+}
+
+//! Runs the firmware in the simulator and fills cap
+static int golden_simulate(const char *elf, const golden_message *script, size_t script_length)
+{
+	avr_t *avr = sim_load(elf, NULL);
+	if (!avr)
+		return -1;
+
+	avr_irq_t *uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+
+	// Hook the I/O handlers installed by the simulated peripherals
+	if (sim_hook_write(avr, SIM_SPDR, golden_spdr_write, &cap.spdr)
+		|| sim_hook_write(avr, SIM_PORTD, golden_portd_write, &cap.portd)
+		|| sim_hook_read(avr, SIM_UDR0, golden_udr_read, &cap.udr))
+		return -1;
+
+	// Bytes are handed to the simulated UART, which delivers them at the baud rate
+	size_t next = 0;
+	while (cap.iter < GOLDEN_LENGTH)
+	{
+		while (next < script_length && script[next].time <= cap.iter)
+		{
+			for (uint8_t i = 0; i < script[next].length; i++)
+				avr_raise_irq(uart_in, script[next].data[i]);
+			next++;
+		}
+
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed)
+		{
+			fprintf(stderr, "simulation stopped after %" PRIu32 " iterations\n", cap.iter);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+//! Feeds the host engine with the captured MIDI data and compares the outputs
+static int golden_compare(void)
+{
+	static usynth_instance synth;
+	usynth_init(&synth);
+
+	// Host output of every iteration, preceded by the initial dac_data
+	uint16_t *host = calloc(GOLDEN_LENGTH + 2, sizeof(uint16_t));
+	if (!host) return -1;
+	host++;
+
+	uint32_t m = 0;
+	for (uint32_t i = 0; i <= GOLDEN_LENGTH; i++)
+	{
+		while (m < cap.midi_count && cap.midi_iter[m] + 1 <= i)
+			usynth_midi_put(&synth, cap.midi[m++]);
+		host[i] = usynth_update(&synth);
+	}
+
+	const uint16_t mcp4921_conf = MCP4921_SHDN_BIT | MCP4921_GAIN_BIT | MCP4921_VREF_BUF_BIT;
+	uint32_t mismatches[GOLDEN_SEGMENT_COUNT] = {0};
+	uint32_t late[GOLDEN_SEGMENT_COUNT] = {0};
+	uint32_t total_mismatches = 0;
+
+	for (uint32_t w = 0; w < cap.word_count; w++)
+	{
+		uint32_t i = cap.word_iter[w];
+		if (i >= GOLDEN_LENGTH) break;
+		uint8_t segment = i / GOLDEN_SEGMENT_LENGTH;
+
+		uint16_t word = cap.words[w];
+		uint16_t expected = mcp4921_conf | (host[i] >> 4);
+		uint16_t previous = mcp4921_conf | (i ? host[i - 1] >> 4 : 0);
+
+		if (word == expected)
+			continue;
+		else if (word == previous)
+			late[segment]++;
+		else
+		{
+			if (!total_mismatches)
+				fprintf(stderr, "first mismatch at iteration %" PRIu32 ": firmware 0x%04x, host 0x%04x\n",
+					i, word, expected);
+			mismatches[segment]++;
+			total_mismatches++;
+		}
+	}
+
+	for (uint8_t p = 0; p < GOLDEN_SEGMENT_COUNT; p++)
+		printf("program %d: %s (%" PRIu32 " mismatched, %" PRIu32 " late samples)\n",
+			p, mismatches[p] ? "FAIL" : "ok", mismatches[p], late[p]);
+
+	free(host - 1);
+	return total_mismatches ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s <firmware.elf>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	size_t n = GOLDEN_LENGTH + F_SAMPLE;
+	cap.words = malloc(n * sizeof(uint16_t));
+	cap.word_iter = malloc(n * sizeof(uint32_t));
+	cap.midi = malloc(GOLDEN_LENGTH * sizeof(uint8_t));
+	cap.midi_iter = malloc(GOLDEN_LENGTH * sizeof(uint32_t));
+	golden_message *script = malloc(GOLDEN_SEGMENT_COUNT * 16 * sizeof(golden_message));
+	if (!cap.words || !cap.word_iter || !cap.midi || !cap.midi_iter || !script)
+		return EXIT_FAILURE;
+
+	size_t script_length = golden_script(script);
+	if (golden_simulate(argv[1], script, script_length))
+		return EXIT_FAILURE;
+
+	printf("captured %" PRIu32 " samples and %" PRIu32 " MIDI bytes\n", cap.word_count, cap.midi_count);
+	return golden_compare() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,343 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ppg/ppg.h"
+#include "../ppg/ppg_data.h"
+#include "bank.h"
+#include "bank_osc.h"
+#include "bank_eg.h"
+#include "bank_lfo.h"
+
+/**
+	\file Voice bank kernel test
+
+	Runs the kernels this file is compiled for (AVX2, SSE2 or scalar,
+	see bank_osc.h, bank_eg.h and bank_lfo.h) on random state and compares
+	every result with the scalar reference kernels, which call the firmware
+	code. make test-kernels builds it once per instruction set.
+
+	The states are random, but the values are biased towards the ends
+	of their ranges, where the saturation and wrapping paths are.
+*/
+
+#if !defined(USYNTH_BANK_SCALAR) && defined(__AVX2__)
+#define KERNELS_NAME "AVX2"
+#elif !defined(USYNTH_BANK_SCALAR) && defined(__SSE2__)
+#define KERNELS_NAME "SSE2"
+#else
+#define KERNELS_NAME "scalar"
+#endif
+
+#define KERNELS_VOICES (2 * USYNTH_BANK_LANES)
+#define KERNELS_TRIALS 20000
+#define KERNELS_STEPS  8
+
+static uint32_t kernels_seed = 1;
+
+static uint32_t kernels_rand(void)
+{
+	// xorshift32
+	kernels_seed ^= kernels_seed << 13;
+	kernels_seed ^= kernels_seed >> 17;
+	kernels_seed ^= kernels_seed << 5;
+	return kernels_seed;
+}
+
+//! Random 16-bit value, often close to 0 or UINT16_MAX
+static uint16_t kernels_rand16(void)
+{
+	uint32_t r = kernels_rand();
+	switch (r & 3)
+	{
+		case 0: return r >> 16 & 0xff;
+		case 1: return 0xffff - (r >> 16 & 0xff);
+		default: return r >> 16;
+	}
+}
+
+//! Random signed 16-bit value, often close to 0, INT16_MIN or INT16_MAX
+static int16_t kernels_rand_s16(void)
+{
+	uint32_t r = kernels_rand();
+	switch (r & 3)
+	{
+		case 0: return INT16_MIN + (r >> 16 & 0xff);
+		case 1: return INT16_MAX - (r >> 16 & 0xff);
+		case 2: return (int16_t)(r >> 16 & 0x1ff) - 0x100;
+		default: return r >> 16;
+	}
+}
+
+static int kernels_fail(const char *kernel, unsigned trial, size_t i, long expected, long got)
+{
+	fprintf(stderr, "%s %s kernel mismatch - trial %u, lane %zu: expected %ld, got %ld\n",
+		KERNELS_NAME, kernel, trial, i, expected, got);
+	return -1;
+}
+
+static void kernels_eg_randomize(usynth_bank_eg *eg)
+{
+	eg->attack = kernels_rand16();
+	eg->release = kernels_rand16();
+	eg->sustain = kernels_rand();
+	eg->sustain_enabled = kernels_rand() & 1;
+
+	for (size_t i = 0; i < KERNELS_VOICES; i++)
+	{
+		eg->status[i] = kernels_rand() & 3;
+		eg->gate[i] = kernels_rand() & 1;
+		eg->value[i] = kernels_rand16();
+	}
+}
+
+//! Envelope generators, usynth_bank_eg_update() against usynth_eg_update()
+static int kernels_test_eg(usynth_bank *bank)
+{
+	usynth_bank_eg *eg = &bank->amp_eg;
+	uint8_t status[KERNELS_VOICES];
+	uint16_t value[KERNELS_VOICES];
+	uint16_t output[KERNELS_VOICES];
+
+	for (unsigned trial = 0; trial < KERNELS_TRIALS; trial++)
+	{
+		kernels_eg_randomize(eg);
+
+		for (unsigned step = 0; step < KERNELS_STEPS; step++)
+		{
+			memcpy(status, eg->status, sizeof(status));
+			memcpy(value, eg->value, sizeof(value));
+			usynth_bank_eg_update(eg, 0, KERNELS_VOICES);
+
+			uint8_t got_status[KERNELS_VOICES];
+			uint16_t got_value[KERNELS_VOICES];
+			memcpy(got_status, eg->status, sizeof(got_status));
+			memcpy(got_value, eg->value, sizeof(got_value));
+			memcpy(output, eg->output, sizeof(output));
+
+			memcpy(eg->status, status, sizeof(status));
+			memcpy(eg->value, value, sizeof(value));
+			usynth_bank_eg_update_scalar(eg, 0, KERNELS_VOICES);
+
+			for (size_t i = 0; i < KERNELS_VOICES; i++)
+			{
+				if (got_status[i] != eg->status[i])
+					return kernels_fail("EG status", trial, i, eg->status[i], got_status[i]);
+				if (got_value[i] != eg->value[i])
+					return kernels_fail("EG value", trial, i, eg->value[i], got_value[i]);
+				if (output[i] != eg->output[i])
+					return kernels_fail("EG output", trial, i, eg->output[i], output[i]);
+			}
+
+			// Gates change now and then, like notes do
+			if (kernels_rand() % 4 == 0)
+				eg->gate[kernels_rand() % KERNELS_VOICES] ^= 1;
+		}
+	}
+
+	return 0;
+}
+
+static void kernels_lfo_randomize(usynth_bank_lfo *lfo)
+{
+	lfo->step = kernels_rand() & 0x7fff;
+	lfo->fade_step = kernels_rand16();
+	lfo->waveform = kernels_rand() & 1;
+	lfo->common_value = kernels_rand_s16();
+	lfo->common_status = kernels_rand() & USYNTH_LFO_DIR_BIT;
+
+	for (size_t i = 0; i < KERNELS_VOICES; i++)
+	{
+		lfo->value[i] = kernels_rand_s16();
+		lfo->status[i] = kernels_rand() & USYNTH_LFO_DIR_BIT;
+		lfo->gate[i] = kernels_rand() & 1;
+		lfo->fade[i] = kernels_rand16();
+	}
+}
+
+//! LFOs with their own phase, usynth_bank_lfo_update() against usynth_lfo_update()
+static int kernels_test_lfo(usynth_bank *bank)
+{
+	usynth_bank_lfo *lfo = &bank->lfo;
+	int16_t value[KERNELS_VOICES];
+	uint16_t fade[KERNELS_VOICES];
+	uint8_t status[KERNELS_VOICES];
+
+	for (unsigned trial = 0; trial < KERNELS_TRIALS; trial++)
+	{
+		kernels_lfo_randomize(lfo);
+
+		for (unsigned step = 0; step < KERNELS_STEPS; step++)
+		{
+			memcpy(value, lfo->value, sizeof(value));
+			memcpy(fade, lfo->fade, sizeof(fade));
+			memcpy(status, lfo->status, sizeof(status));
+			usynth_bank_lfo_update(lfo, 0, KERNELS_VOICES, 0, 0);
+
+			int16_t got_value[KERNELS_VOICES];
+			int16_t got_output[KERNELS_VOICES];
+			uint16_t got_fade[KERNELS_VOICES];
+			uint8_t got_status[KERNELS_VOICES];
+			memcpy(got_value, lfo->value, sizeof(got_value));
+			memcpy(got_output, lfo->output, sizeof(got_output));
+			memcpy(got_fade, lfo->fade, sizeof(got_fade));
+			memcpy(got_status, lfo->status, sizeof(got_status));
+
+			memcpy(lfo->value, value, sizeof(value));
+			memcpy(lfo->fade, fade, sizeof(fade));
+			memcpy(lfo->status, status, sizeof(status));
+			usynth_bank_lfo_update_scalar(lfo, 0, KERNELS_VOICES);
+
+			for (size_t i = 0; i < KERNELS_VOICES; i++)
+			{
+				if (got_value[i] != lfo->value[i])
+					return kernels_fail("LFO value", trial, i, lfo->value[i], got_value[i]);
+				if (got_status[i] != lfo->status[i])
+					return kernels_fail("LFO status", trial, i, lfo->status[i], got_status[i]);
+				if (got_fade[i] != lfo->fade[i])
+					return kernels_fail("LFO fade", trial, i, lfo->fade[i], got_fade[i]);
+				if (got_output[i] != lfo->output[i])
+					return kernels_fail("LFO output", trial, i, lfo->output[i], got_output[i]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+	LFOs sharing the common phase - each voice must get what
+	usynth_lfo_update() gives when started from the common phase
+*/
+static int kernels_test_lfo_shared(usynth_bank *bank)
+{
+	usynth_bank_lfo *lfo = &bank->lfo;
+
+	for (unsigned trial = 0; trial < KERNELS_TRIALS; trial++)
+	{
+		kernels_lfo_randomize(lfo);
+
+		for (unsigned step = 0; step < KERNELS_STEPS; step++)
+		{
+			usynth_lfo ref[KERNELS_VOICES];
+			for (size_t i = 0; i < KERNELS_VOICES; i++)
+			{
+				ref[i] = (usynth_lfo){
+					.step = lfo->step,
+					.waveform = lfo->waveform,
+					.fade_step = lfo->fade_step,
+					.fade = lfo->fade[i],
+					.value = lfo->common_value,
+					.status = lfo->common_status,
+					.gate = lfo->gate[i],
+				};
+				usynth_lfo_update(&ref[i]);
+			}
+
+			usynth_bank_lfo_update(lfo, 0, KERNELS_VOICES, 1, usynth_bank_lfo_advance(lfo));
+
+			for (size_t i = 0; i < KERNELS_VOICES; i++)
+			{
+				if (lfo->common_value != ref[i].value)
+					return kernels_fail("shared LFO value", trial, i, ref[i].value, lfo->common_value);
+				if (lfo->common_status != ref[i].status)
+					return kernels_fail("shared LFO status", trial, i, ref[i].status, lfo->common_status);
+				if (lfo->fade[i] != ref[i].fade)
+					return kernels_fail("shared LFO fade", trial, i, ref[i].fade, lfo->fade[i]);
+				if (lfo->output[i] != ref[i].output)
+					return kernels_fail("shared LFO output", trial, i, ref[i].output, lfo->output[i]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+//! Oscillators, usynth_bank_osc_render() against ppg_get_wavetable_sample()
+static int kernels_test_osc(usynth_bank *bank)
+{
+	static ppg_wavetable_entry wavetables[PPG_WAVETABLE_COUNT][PPG_DEFAULT_WAVETABLE_SIZE];
+	for (uint8_t i = 0; i < PPG_WAVETABLE_COUNT; i++)
+		ppg_load_wavetable_n(wavetables[i], PPG_DEFAULT_WAVETABLE_SIZE, ppg_wavetable_data, i);
+
+	static _Alignas(USYNTH_BANK_ALIGN) uint32_t mix[256][USYNTH_BANK_MIX_WIDTH];
+	static _Alignas(USYNTH_BANK_ALIGN) uint32_t ref[256][USYNTH_BANK_MIX_WIDTH];
+	uint16_t phase[USYNTH_BANK_LANES];
+
+	for (unsigned trial = 0; trial < KERNELS_TRIALS; trial++)
+	{
+		size_t first = kernels_rand() % (KERNELS_VOICES / USYNTH_BANK_LANES) * USYNTH_BANK_LANES;
+		uint8_t n = 1 + kernels_rand() % 255;
+
+		for (size_t i = first; i < first + USYNTH_BANK_LANES; i++)
+		{
+			const ppg_wavetable_entry *e = &wavetables[kernels_rand() % PPG_WAVETABLE_COUNT][kernels_rand() % PPG_DEFAULT_WAVETABLE_SIZE];
+			bank->osc.wave_l[i] = e->wave_l;
+			bank->osc.wave_r[i] = e->wave_r;
+			bank->osc.factor[i] = kernels_rand();
+			bank->osc.phase[i] = kernels_rand();
+			bank->osc.phase_step[i] = kernels_rand16();
+			bank->amp_eg.output[i] = kernels_rand16();
+			bank->velocity[i] = kernels_rand() & 0x7f;
+		}
+
+		memset(mix, 0, sizeof(mix));
+		memset(ref, 0, sizeof(ref));
+		memcpy(phase, &bank->osc.phase[first], sizeof(phase));
+		usynth_bank_osc_render(bank, first, mix, n);
+
+		uint16_t got_phase[USYNTH_BANK_LANES];
+		memcpy(got_phase, &bank->osc.phase[first], sizeof(got_phase));
+		memcpy(&bank->osc.phase[first], phase, sizeof(phase));
+		usynth_bank_osc_render_scalar(bank, first, ref, n);
+
+		for (size_t i = 0; i < USYNTH_BANK_LANES; i++)
+			if (got_phase[i] != bank->osc.phase[first + i])
+				return kernels_fail("oscillator phase", trial, first + i, bank->osc.phase[first + i], got_phase[i]);
+
+		// The partial sums may be split differently, only their totals count
+		for (uint8_t t = 0; t < n; t++)
+		{
+			uint32_t got = 0, expected = 0;
+			for (size_t j = 0; j < USYNTH_BANK_MIX_WIDTH; j++)
+			{
+				got += mix[t][j];
+				expected += ref[t][j];
+			}
+
+			if (got != expected)
+				return kernels_fail("oscillator mix", trial, t, expected, got);
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+#if !defined(USYNTH_BANK_SCALAR) && defined(__AVX2__)
+	if (!__builtin_cpu_supports("avx2"))
+	{
+		printf("%s kernels: skipped, the CPU doesn't support them\n", KERNELS_NAME);
+		return EXIT_SUCCESS;
+	}
+#endif
+
+	usynth_bank bank;
+	if (usynth_bank_init(&bank, KERNELS_VOICES, 1))
+	{
+		fprintf(stderr, "cannot initialize the voice bank\n");
+		return EXIT_FAILURE;
+	}
+
+	int err = kernels_test_eg(&bank)
+		|| kernels_test_lfo(&bank)
+		|| kernels_test_lfo_shared(&bank)
+		|| kernels_test_osc(&bank);
+
+	usynth_bank_free(&bank);
+	printf("%s kernels: %s\n", KERNELS_NAME, err ? "FAIL" : "ok");
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,337 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../usynth.h"
+#include "../midi_cc.h"
+#include "hal_host.h"
+
+/**
+	\file MIDI input test
+
+	Feeds byte streams into the synth engine through the MIDI ring buffer
+	and checks the state they leave behind and the SysEx replies. Streams that overflow the
+	buffer are compared with a second synth given only the bytes that
+	are expected to get through, so the test doesn't depend on how the
+	notes and controllers are applied.
+*/
+
+//! Control cycles run to drain the input buffer completely
+#define MIDI_TEST_DRAIN_CYCLES 300
+
+//! Length of a whole patch dump message
+#define MIDI_TEST_DUMP_SIZE (MIDI_PATCH_SIZE + 4)
+
+//! Bytes transmitted by the synth
+typedef struct midi_test_reply
+{
+	uint8_t data[2 * MIDI_TEST_DUMP_SIZE];
+	size_t len;
+} midi_test_reply;
+
+static void midi_test_put(usynth_instance *synth, const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		usynth_midi_put(synth, data[i]);
+}
+
+static void midi_test_run(usynth_instance *synth, unsigned cycles)
+{
+	for (unsigned i = 0; i < cycles * USYNTH_CONTROL_SLOTS; i++)
+		usynth_update(synth);
+}
+
+static void midi_test_tx(void *ctx, uint8_t byte)
+{
+	midi_test_reply *reply = ctx;
+	if (reply->len < sizeof(reply->data))
+		reply->data[reply->len++] = byte;
+}
+
+//! Puts a stream of messages with running status, then fills the buffer with active sensing
+static void midi_test_fill(usynth_instance *synth, uint8_t status)
+{
+	usynth_midi_put(synth, status);
+	for (unsigned i = 0; i < 200; i++)
+	{
+		usynth_midi_put(synth, 20 + i % 80);
+		usynth_midi_put(synth, 1 + i % 100);
+	}
+
+	while (usynth_midi_space(synth))
+		usynth_midi_put(synth, 0xfe);
+}
+
+//! Compares the state MIDI input affects
+static int midi_test_compare(const char *test, const usynth_instance *a, const usynth_instance *b)
+{
+	const midi_status *x = &a->midi, *y = &b->midi;
+	int same = !memcmp(x->control, y->control, sizeof(x->control))
+		&& !memcmp(x->voices, y->voices, sizeof(x->voices))
+		&& x->gate_mask == y->gate_mask
+		&& x->program == y->program
+		&& x->pitchbend == y->pitchbend;
+
+	if (!same)
+		fprintf(stderr, "%s: MIDI state differs from the expected one\n", test);
+	return same ? 0 : -1;
+}
+
+/**
+	SysEx arriving while the buffer is full - F0 is dropped, so its data
+	must not get in once there's space again, or it would be taken as
+	running status notes or controllers
+*/
+static int midi_test_overflow_sysex(void)
+{
+	static const uint8_t status[] = {0x90, 0xb0};
+	static const uint8_t sysex[] = {0x7d, 0x45, 0x7f, 0x67, 0x33, 0xf7};
+	static const uint8_t after[] = {0x80, 60, 0};
+
+	for (size_t i = 0; i < sizeof(status); i++)
+	{
+		usynth_instance synth, expected;
+		usynth_init(&synth);
+		usynth_init(&expected);
+
+		midi_test_fill(&synth, status[i]);
+		midi_test_fill(&expected, status[i]);
+
+		uint16_t dropped = synth.midi_health.counters.dropped_messages;
+		usynth_midi_put(&synth, 0xf0);
+		if (synth.midi_health.counters.dropped_messages != dropped + 1)
+		{
+			fprintf(stderr, "overflow: F0 hasn't been dropped\n");
+			return -1;
+		}
+
+		midi_test_run(&synth, 2);
+		midi_test_run(&expected, 2);
+
+		// Only F7 ends up in the buffer
+		midi_test_put(&synth, sysex, sizeof(sysex));
+		midi_test_put(&synth, after, sizeof(after));
+		midi_test_put(&expected, sysex + sizeof(sysex) - 1, 1);
+		midi_test_put(&expected, after, sizeof(after));
+
+		midi_test_run(&synth, MIDI_TEST_DRAIN_CYCLES);
+		midi_test_run(&expected, MIDI_TEST_DRAIN_CYCLES);
+
+		if (midi_test_compare("overflow", &synth, &expected))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+	Controller message dropped while the buffer is full - its running
+	status is sent again before the next message that fits
+*/
+static int midi_test_overflow_running(void)
+{
+	static const uint8_t cc[] = {0xb0, MIDI_CUTOFF, 99};
+	static const uint8_t data[] = {MIDI_CUTOFF, 42};
+
+	usynth_instance synth;
+	usynth_init(&synth);
+	midi_test_fill(&synth, 0x90);
+
+	midi_test_put(&synth, cc, sizeof(cc));
+	midi_test_run(&synth, 2);
+	midi_test_put(&synth, data, sizeof(data));
+	midi_test_run(&synth, MIDI_TEST_DRAIN_CYCLES);
+
+	if (synth.midi.control[MIDI_CUTOFF] != 42)
+	{
+		fprintf(stderr, "overflow: running status hasn't been restored\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+//! Builds a patch dump message with arbitrary values
+static void midi_test_dump(uint8_t *dump, uint8_t seed)
+{
+	dump[0] = 0xf0;
+	dump[1] = MIDI_SYSEX_ID;
+	dump[2] = MIDI_SYSEX_PATCH;
+	for (uint8_t i = 0; i < MIDI_PATCH_SIZE; i++)
+		dump[3 + i] = (seed + 37 * i) & 0x7f;
+	dump[3 + MIDI_PATCH_SIZE] = 0xf7;
+}
+
+/**
+	Patch dump completed while the EG, LFO and modulation slots drain the
+	buffer - the patch must be loaded in a MIDI slot anyway
+*/
+static int midi_test_patch_slot(void)
+{
+	uint8_t dump[MIDI_TEST_DUMP_SIZE];
+	midi_test_dump(dump, 1);
+
+	// Shift the dump, so it ends in every slot that reads MIDI
+	for (unsigned shift = 0; shift < 2 * USYNTH_CONTROL_SLOTS; shift++)
+	{
+		usynth_instance synth;
+		usynth_init(&synth);
+		midi_test_put(&synth, (const uint8_t[]){0xc0, 1}, 2);
+		midi_test_run(&synth, 4);
+
+		for (unsigned i = 0; i < shift; i++)
+			usynth_midi_put(&synth, 0xfe);
+		midi_test_put(&synth, dump, sizeof(dump));
+
+		for (unsigned i = 0; i < MIDI_TEST_DRAIN_CYCLES * USYNTH_CONTROL_SLOTS && synth.midi.program != 0xff; i++)
+		{
+			uint8_t slot = synth.load_balancer_cnt;
+			usynth_update(&synth);
+			if (synth.midi.program == 0xff && slot >= USYNTH_SLOT_MIDI + USYNTH_MIDI_SLOTS)
+			{
+				fprintf(stderr, "patch dump: loaded in slot %u\n", slot);
+				return -1;
+			}
+		}
+
+		if (synth.midi.program != 0xff)
+		{
+			fprintf(stderr, "patch dump: not loaded\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+	Requests a patch dump and receives the reply. The message given is
+	sent while the reply is being transmitted.
+*/
+static int midi_test_get_dump(usynth_instance *synth, uint8_t *dump, const uint8_t *msg, size_t msg_len)
+{
+	static const uint8_t request[] = {0xf0, MIDI_SYSEX_ID, MIDI_SYSEX_PATCH_REQUEST, 0xf7};
+	static const uint8_t header[] = {0xf0, MIDI_SYSEX_ID, MIDI_SYSEX_PATCH};
+
+	midi_test_reply reply = {.len = 0};
+	hal_host_set_midi_tx_handler(midi_test_tx, &reply);
+	midi_test_put(synth, request, sizeof(request));
+	midi_test_run(synth, 10);
+	size_t sent = reply.len;
+	midi_test_put(synth, msg, msg_len);
+	midi_test_run(synth, 2 * MIDI_TEST_DUMP_SIZE);
+	hal_host_set_midi_tx_handler(NULL, NULL);
+
+	if (!sent || sent >= MIDI_TEST_DUMP_SIZE)
+	{
+		fprintf(stderr, "patch dump: request not answered in time\n");
+		return -1;
+	}
+
+	if (reply.len != MIDI_TEST_DUMP_SIZE || memcmp(reply.data, header, sizeof(header))
+		|| reply.data[MIDI_TEST_DUMP_SIZE - 1] != 0xf7)
+	{
+		fprintf(stderr, "patch dump: malformed reply (%zu bytes)\n", reply.len);
+		return -1;
+	}
+
+	memcpy(dump, reply.data, MIDI_TEST_DUMP_SIZE);
+	return 0;
+}
+
+/**
+	Dumps a preset, loads the dump into another synth and dumps it again.
+	A controller changed during the transfer must not get into the dump.
+*/
+static int midi_test_patch_round_trip(void)
+{
+	uint8_t preset[MIDI_TEST_DUMP_SIZE], changed[MIDI_TEST_DUMP_SIZE];
+	uint8_t defaults[MIDI_TEST_DUMP_SIZE], loaded[MIDI_TEST_DUMP_SIZE];
+
+	usynth_instance synth, other;
+	usynth_init(&synth);
+	usynth_init(&other);
+	midi_test_put(&synth, (const uint8_t[]){0xc0, 3}, 2);
+	midi_test_run(&synth, 4);
+
+	uint8_t cutoff = synth.midi.control[MIDI_CUTOFF] ^ 0x40;
+	if (midi_test_get_dump(&synth, preset, NULL, 0)
+		|| midi_test_get_dump(&synth, changed, (const uint8_t[]){0xb0, MIDI_CUTOFF, cutoff}, 3)
+		|| midi_test_get_dump(&other, defaults, NULL, 0))
+		return -1;
+
+	if (synth.midi.control[MIDI_CUTOFF] != cutoff || memcmp(preset, changed, sizeof(preset)))
+	{
+		fprintf(stderr, "patch dump: changed during the transfer\n");
+		return -1;
+	}
+
+	midi_test_put(&other, preset, sizeof(preset));
+	midi_test_run(&other, MIDI_TEST_DRAIN_CYCLES);
+	if (midi_test_get_dump(&other, loaded, NULL, 0))
+		return -1;
+
+	if (!memcmp(preset, defaults, sizeof(preset)) || memcmp(preset, loaded, sizeof(preset))
+		|| other.midi.program != 0xff)
+	{
+		fprintf(stderr, "patch dump: not loaded back\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+//! SysEx messages that must be ignored - wrong ID, truncated and too long patch dumps
+static int midi_test_patch_broken(void)
+{
+	uint8_t dump[MIDI_TEST_DUMP_SIZE];
+	midi_test_dump(dump, 5);
+
+	uint8_t wrong_id[MIDI_TEST_DUMP_SIZE], truncated[MIDI_TEST_DUMP_SIZE - 1], too_long[MIDI_TEST_DUMP_SIZE + 1];
+	memcpy(wrong_id, dump, sizeof(dump));
+	wrong_id[1] = MIDI_SYSEX_ID + 1;
+	memcpy(truncated, dump, sizeof(truncated) - 1);
+	truncated[sizeof(truncated) - 1] = 0xf7;
+	memcpy(too_long, dump, sizeof(dump) - 1);
+	too_long[sizeof(too_long) - 2] = 0x11;
+	too_long[sizeof(too_long) - 1] = 0xf7;
+
+	const struct {const char *name; const uint8_t *data; size_t len;} cases[] =
+	{
+		{"wrong ID",  wrong_id,  sizeof(wrong_id) },
+		{"truncated", truncated, sizeof(truncated)},
+		{"too long",  too_long,  sizeof(too_long) },
+	};
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		usynth_instance synth, expected;
+		usynth_init(&synth);
+		usynth_init(&expected);
+		midi_test_put(&synth, (const uint8_t[]){0xc0, 1}, 2);
+		midi_test_put(&expected, (const uint8_t[]){0xc0, 1}, 2);
+
+		midi_test_put(&synth, cases[i].data, cases[i].len);
+		midi_test_run(&synth, MIDI_TEST_DRAIN_CYCLES);
+		midi_test_run(&expected, MIDI_TEST_DRAIN_CYCLES);
+
+		if (midi_test_compare(cases[i].name, &synth, &expected))
+			return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int err = midi_test_overflow_sysex()
+		|| midi_test_overflow_running()
+		|| midi_test_patch_slot()
+		|| midi_test_patch_round_trip()
+		|| midi_test_patch_broken();
+
+	printf("MIDI input: %s\n", err ? "FAIL" : "ok");
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
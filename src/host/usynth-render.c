@@ -0,0 +1,307 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../usynth.h"
+#include "bank.h"
+#include "cluster.h"
+#include "smf.h"
+#include "wav.h"
+
+/**
+	\file Offline MIDI file to WAV renderer
+
+	Feeds a Standard MIDI File into the synth engine the same way the
+	firmware receives it - byte by byte through the MIDI ring buffer,
+	paced by the UART baud rate - and writes the output to a WAV file.
+
+	With -b, the voice bank is used instead and each message is delivered
+	as a whole once its last byte has been transmitted. With -c, the file
+	is played by a simulated cluster of chips, each in its own thread.
+*/
+
+#ifndef F_SAMPLE
+#error F_SAMPLE is not defined!
+#endif
+
+#ifndef MIDI_BAUD
+#define MIDI_BAUD 31250
+#endif
+
+#define RENDER_BLOCK_SIZE 4096
+
+//! Output stage - optional DAC emulation and linear resampling
+typedef struct render_output
+{
+	wav_writer wav;
+	uint8_t dac_bits;
+	double step;
+	double pos;
+	int16_t last;
+	int16_t buf[RENDER_BLOCK_SIZE];
+} render_output;
+
+//! The synth and the profiling data
+typedef struct render_state
+{
+	usynth_instance synth;
+	usynth_bank bank;
+	size_t bank_voices;    //!< Non-zero when rendering with the bank
+	usynth_cluster cluster;
+	unsigned cluster_size; //!< Non-zero when rendering with a cluster
+	render_output out;
+	int16_t buf[RENDER_BLOCK_SIZE];
+	uint64_t samples;
+	double render_time;
+	int error;
+} render_state;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void render_output_write(render_output *out, int16_t *data, size_t frames, int *error)
+{
+	// Emulate the 12-bit DAC
+	if (out->dac_bits)
+		for (size_t i = 0; i < frames; i++)
+			data[i] = (int16_t)(((uint16_t)(data[i] + 32768) & (0xffff << (16 - out->dac_bits))) - 32768);
+
+	if (out->step == 1.0)
+	{
+		if (wav_write(&out->wav, data, frames)) *error = 1;
+		return;
+	}
+
+	// Linear interpolation between the last sample and the current one
+	size_t n = 0;
+	for (size_t i = 0; i < frames; i++)
+	{
+		while (out->pos < 1.0)
+		{
+			out->buf[n++] = lrint(out->last + (data[i] - out->last) * out->pos);
+			out->pos += out->step;
+
+			if (n == RENDER_BLOCK_SIZE)
+			{
+				if (wav_write(&out->wav, out->buf, n)) *error = 1;
+				n = 0;
+			}
+		}
+
+		out->pos -= 1.0;
+		out->last = data[i];
+	}
+
+	if (wav_write(&out->wav, out->buf, n)) *error = 1;
+}
+
+//! Renders samples until the given sample number
+static void render_until(render_state *rs, uint64_t end)
+{
+	while (rs->samples < end)
+	{
+		size_t n = end - rs->samples < RENDER_BLOCK_SIZE ? end - rs->samples : RENDER_BLOCK_SIZE;
+
+		double t = now();
+		if (rs->bank_voices)
+			usynth_bank_render(&rs->bank, rs->buf, n);
+		else
+			usynth_render(&rs->synth, rs->buf, n);
+		rs->render_time += now() - t;
+
+		rs->samples += n;
+		render_output_write(&rs->out, rs->buf, n, &rs->error);
+	}
+}
+
+//! Receives the mixed output of the cluster
+static void render_cluster_output(void *ctx, int16_t *data, size_t frames)
+{
+	render_state *rs = ctx;
+	rs->samples += frames;
+	render_output_write(&rs->out, data, frames, &rs->error);
+}
+
+//! Writes a byte to the synth's MIDI buffer - waits for room, so nothing is dropped
+static void render_midi_put(render_state *rs, uint8_t byte)
+{
+	while (usynth_midi_space(&rs->synth) < USYNTH_HEALTH_MSG_MAX)
+		render_until(rs, rs->samples + USYNTH_CONTROL_SLOTS);
+
+	usynth_midi_put(&rs->synth, byte);
+}
+
+//! Makes a byte available at given sample time - the bank gets whole messages instead
+static void render_midi_byte(render_state *rs, uint64_t time, uint8_t byte)
+{
+	if (rs->cluster_size)
+	{
+		usynth_cluster_midi(&rs->cluster, time, byte);
+		return;
+	}
+
+	render_until(rs, time);
+	if (!rs->bank_voices)
+		render_midi_put(rs, byte);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <input.mid> <output.wav>\n"
+		"  -p <program>  send program change before playing (presets start at 1)\n"
+		"  -t <seconds>  time to render after the last event (default 2)\n"
+		"  -r <rate>     resample output to given rate (default %d)\n"
+		"  -d            quantize output to 12 bits like the DAC does\n"
+		"  -u            don't limit MIDI data rate to %d baud\n"
+		"  -b <voices>   render with a voice bank of given polyphony\n"
+		"  -j <threads>  number of threads rendering the voice bank (default 1)\n"
+		"  -c <chips>    render with a cluster of up to %d chips, one thread each\n",
+		argv0, F_SAMPLE, MIDI_BAUD, USYNTH_CLUSTER_MAX_NODES);
+}
+
+int main(int argc, char *argv[])
+{
+	int program = -1;
+	double tail = 2.0;
+	long rate = F_SAMPLE;
+	int dac = 0;
+	int unlimited = 0;
+	long bank_voices = 0;
+	int threads = 1;
+	int cluster_size = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:t:r:dub:j:c:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				// Negative values would mean no program change
+				program = atoi(optarg);
+				if (program < 0)
+				{
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't': tail = atof(optarg); break;
+			case 'r': rate = atol(optarg); break;
+			case 'd': dac = 1; break;
+			case 'u': unlimited = 1; break;
+			case 'b': bank_voices = atol(optarg); break;
+			case 'j': threads = atoi(optarg); break;
+			case 'c': cluster_size = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 2 || program > 127 || rate <= 0 || tail < 0 || bank_voices < 0 || threads < 1
+		|| cluster_size < 0 || cluster_size > USYNTH_CLUSTER_MAX_NODES || (cluster_size && bank_voices))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	smf_file smf;
+	if (smf_load(&smf, argv[optind]))
+		return EXIT_FAILURE;
+
+	static render_state rs;
+	usynth_init(&rs.synth);
+	rs.bank_voices = bank_voices;
+	if (rs.bank_voices && usynth_bank_init(&rs.bank, rs.bank_voices, threads))
+	{
+		fprintf(stderr, "cannot allocate a bank of %ld voices\n", bank_voices);
+		smf_free(&smf);
+		return EXIT_FAILURE;
+	}
+	rs.cluster_size = cluster_size;
+	if (rs.cluster_size && usynth_cluster_init(&rs.cluster, rs.cluster_size, render_cluster_output, &rs))
+	{
+		fprintf(stderr, "cannot start a cluster of %d chips\n", cluster_size);
+		smf_free(&smf);
+		return EXIT_FAILURE;
+	}
+	rs.out.dac_bits = dac ? 12 : 0;
+	rs.out.step = (double) F_SAMPLE / rate;
+	if (wav_open(&rs.out.wav, argv[optind + 1], rate))
+	{
+		usynth_cluster_free(&rs.cluster);
+		usynth_bank_free(&rs.bank);
+		smf_free(&smf);
+		return EXIT_FAILURE;
+	}
+
+	double t_start = now();
+
+	if (program >= 0 && rs.bank_voices)
+		usynth_bank_midi(&rs.bank, (const uint8_t[]){0xc0, program}, 2);
+	else if (program >= 0)
+	{
+		render_midi_byte(&rs, 0, 0xc0);
+		render_midi_byte(&rs, 0, program);
+	}
+
+	// Each byte becomes available to the synth once it's been
+	// fully transmitted over the serial link
+	const double byte_time = 10.0 * F_SAMPLE / MIDI_BAUD;
+	double line_free = 0;
+	for (size_t i = 0; i < smf.count; i++)
+	{
+		for (uint8_t j = 0; j < smf.events[i].length; j++)
+		{
+			double t = smf.events[i].time * F_SAMPLE;
+			if (!unlimited)
+			{
+				t = (t > line_free ? t : line_free) + byte_time;
+				line_free = t;
+			}
+
+			render_midi_byte(&rs, ceil(t), smf.events[i].data[j]);
+		}
+
+		if (rs.bank_voices)
+			usynth_bank_midi(&rs.bank, smf.events[i].data, smf.events[i].length);
+	}
+
+	if (rs.cluster_size)
+		usynth_cluster_finish(&rs.cluster, tail * F_SAMPLE);
+	else
+		render_until(&rs, rs.samples + (uint64_t)(tail * F_SAMPLE));
+
+	if (wav_close(&rs.out.wav) || rs.error)
+	{
+		fprintf(stderr, "%s: write error\n", argv[optind + 1]);
+		usynth_cluster_free(&rs.cluster);
+		usynth_bank_free(&rs.bank);
+		smf_free(&smf);
+		return EXIT_FAILURE;
+	}
+
+	// Performance report
+	double total_time = now() - t_start;
+	double audio_time = (double) rs.samples / F_SAMPLE;
+	fprintf(stderr, "rendered %" PRIu64 " samples (%.2f s of audio)\n", rs.samples, audio_time);
+	if (rs.render_time > 0)
+		fprintf(stderr, "synth: %.3f s, %.0f samples/s, %.0fx real time\n",
+			rs.render_time, rs.samples / rs.render_time, audio_time / rs.render_time);
+	if (total_time > 0)
+		fprintf(stderr, "total: %.3f s, %.0f samples/s, %.0fx real time\n",
+			total_time, rs.samples / total_time, audio_time / total_time);
+
+	usynth_cluster_free(&rs.cluster);
+	usynth_bank_free(&rs.bank);
+	smf_free(&smf);
+	return EXIT_SUCCESS;
+}
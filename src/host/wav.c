@@ -0,0 +1,85 @@
+#include "wav.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static void wav_put_u16(uint8_t *p, uint16_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void wav_put_u32(uint8_t *p, uint32_t x)
+{
+	wav_put_u16(p, x);
+	wav_put_u16(p + 2, x >> 16);
+}
+
+//! Writes RIFF header for the current number of frames
+static int wav_write_header(wav_writer *wav)
+{
+	uint8_t h[44] = {0};
+	uint32_t data_size = wav->frames * 2;
+
+	memcpy(h, "RIFF", 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	memcpy(h + 36, "data", 4);
+	wav_put_u32(h + 4, 36 + data_size);
+	wav_put_u32(h + 16, 16);        // fmt chunk size
+	wav_put_u16(h + 20, 1);         // PCM
+	wav_put_u16(h + 22, 1);         // Mono
+	wav_put_u32(h + 24, wav->rate);
+	wav_put_u32(h + 28, wav->rate * 2);
+	wav_put_u16(h + 32, 2);         // Block align
+	wav_put_u16(h + 34, 16);        // Bits per sample
+	wav_put_u32(h + 40, data_size);
+
+	if (fseek(wav->file, 0, SEEK_SET)) return -1;
+	return fwrite(h, sizeof(h), 1, wav->file) == 1 ? 0 : -1;
+}
+
+/**
+	Creates a new WAV file - the header is completed by wav_close()
+*/
+int wav_open(wav_writer *wav, const char *path, uint32_t rate)
+{
+	wav->rate = rate;
+	wav->frames = 0;
+	wav->file = fopen(path, "wb");
+	if (!wav->file)
+	{
+		perror(path);
+		return -1;
+	}
+
+	return wav_write_header(wav);
+}
+
+int wav_write(wav_writer *wav, const int16_t *data, size_t frames)
+{
+	uint8_t buf[4096];
+	while (frames)
+	{
+		size_t n = frames < sizeof(buf) / 2 ? frames : sizeof(buf) / 2;
+		for (size_t i = 0; i < n; i++)
+			wav_put_u16(buf + 2 * i, data[i]);
+
+		if (fwrite(buf, 2, n, wav->file) != n)
+			return -1;
+
+		wav->frames += n;
+		data += n;
+		frames -= n;
+	}
+
+	return 0;
+}
+
+int wav_close(wav_writer *wav)
+{
+	int err = wav_write_header(wav);
+	if (fclose(wav->file)) err = -1;
+	wav->file = NULL;
+	return err;
+}
@@ -0,0 +1,22 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+	Writes 16-bit mono PCM WAV files
+*/
+typedef struct wav_writer
+{
+	FILE *file;
+	uint32_t rate;
+	uint32_t frames;
+} wav_writer;
+
+extern int wav_open(wav_writer *wav, const char *path, uint32_t rate);
+extern int wav_write(wav_writer *wav, const int16_t *data, size_t frames);
+extern int wav_close(wav_writer *wav);
+
+#endif
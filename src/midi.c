@@ -2,8 +2,22 @@
 #include <stddef.h>
 #include <inttypes.h>
 #include <string.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
 #include "midi_program.h"
+#include "midi_cc.h"
+
+//! Controllers making up a patch - the layout of SysEx patch dumps
+static const midi_patch_range midi_patch_ranges[] PROGMEM =
+{
+	{MIDI_OSC_WAVETABLE(0), 6 }, // Wavetable, base wave, detune
+	{MIDI_OSC_PITCH(0),     10}, // Pitch, amp EG
+	{MIDI_EG_A(0),          12}, // Mod EG
+	{MIDI_LFO_RATE(0),      10}, // LFO
+	{MIDI_LFO_SYNC,         1 }, // LFO sync (reset is a trigger, not patch state)
+	{MIDI_POLY,             2 }, // Poly mode, cutoff
+};
+
+_Static_assert(6 + 10 + 12 + 10 + 1 + 2 == MIDI_PATCH_SIZE, "MIDI_PATCH_SIZE doesn't match midi_patch_ranges");
 
 void midi_init(midi_status *midi, uint8_t voice_count)
 {
@@ -12,53 +26,84 @@ void midi_init(midi_status *midi, uint8_t voice_count)
 	midi->status = 0;
 	midi->channel = 0;
 	midi->voice_count = voice_count;
+	midi->gate_mask = 0;
+	midi->trig_mask = 0;
 
 	midi->program = 0;
 	midi->pitchbend = 8192;
 
+	midi->sysex_pos = MIDI_SYSEX_IGNORE;
+	midi->sysex_type = 0;
+	midi->patch_request = 0;
+
 	memset(midi->voices, 0, sizeof(midi_voice) * MIDI_MAX_VOICES);
 	memset(midi->control, 0, 128);
+	memset(midi->control_dirty, 0xff, sizeof(midi->control_dirty));
 }
 
 /**
-	Loads MIDI preset
+	Loads MIDI preset - presets are numbered from 1, any other
+	id loads the defaults (program 0xff)
 */
 void midi_program_load(midi_status *midi, uint8_t id)
 {
-	// Load defaults before loading anything
-	if (id != 0xff)
-		midi_program_load(midi, 0xff);
+	const midi_program_data *ptr = midi_program_defaults;
+	uint8_t program = 0xff;
+
+	// Jump straight to the preset
+	if (id != 0 && id <= pgm_read_byte(&midi_program_count))
+	{
+		ptr = midi_program_table + pgm_read_word(&midi_program_index[id - 1]);
+		program = id;
+	}
+
+	for (;; ptr++)
+	{
+		uint8_t param = pgm_read_byte(&ptr->param);
+		uint8_t value = pgm_read_byte(&ptr->value);
+
+		// Stop at the next program
+		if (param == MIDI_PARAM_PROGRAM_BEGIN || param == MIDI_PARAM_PROGRAM_TABLE_END)
+			break;
+
+		// If the highest bit is set, the next CC is set as well
+		// Handy when setting CC pairs
+		midi_control_set(midi, param & 0x7f, value & 0x7f);
+		if (param & MIDI_BOTH)
+			midi_control_set(midi, (param & 0x7f) + 1, value & 0x7f);
+	}
 
-	const midi_program_data *ptr;
-	uint8_t param = 0;
-	uint8_t value = 0;
-	uint8_t found = 0;
+	midi->program = program;
+}
 
-	for (ptr = midi_program_table; param != MIDI_PARAM_PROGRAM_TABLE_END; ptr++)
+/**
+	Loads a patch received as SysEx - the controllers are listed in
+	midi_patch_ranges. The patch isn't a preset anymore (program 0xff).
+*/
+void midi_patch_load(midi_status *midi, const uint8_t *data)
+{
+	for (uint8_t i = 0; i < sizeof(midi_patch_ranges) / sizeof(midi_patch_ranges[0]); i++)
 	{
-		param = pgm_read_byte(&ptr->param);
-		value = pgm_read_byte(&ptr->value);
-		
-		// If on desired program label, start writing
-		// If already writing, break
-		if (param == MIDI_PARAM_PROGRAM_BEGIN)
-		{
-			if (found)
-				break;
-			else if (value == id)
-				found = 1;
-		}
-		else if (found)
-		{
-			// If the highest bit is set, the next CC is set as well
-			// Handy when setting CC pairs
-			midi->control[param & 0x7f] = value & 0x7f;
-			if (param & MIDI_BOTH)
-				midi->control[(param & 0x7f) + 1] = value & 0x7f;
-		}
+		uint8_t cc = pgm_read_byte(&midi_patch_ranges[i].first);
+		uint8_t count = pgm_read_byte(&midi_patch_ranges[i].count);
+		while (count--)
+			midi_control_set(midi, cc++, *data++);
 	}
 
-	// On succesful load
-	if (found)
-		midi->program = id;
-}
\ No newline at end of file
+	midi->program = 0xff;
+}
+
+/**
+	Copies the controllers of the current patch in the order of
+	midi_patch_ranges (MIDI_PATCH_SIZE bytes)
+*/
+void midi_patch_store(const midi_status *midi, uint8_t *data)
+{
+	for (uint8_t i = 0; i < sizeof(midi_patch_ranges) / sizeof(midi_patch_ranges[0]); i++)
+	{
+		uint8_t cc = pgm_read_byte(&midi_patch_ranges[i].first);
+		uint8_t count = pgm_read_byte(&midi_patch_ranges[i].count);
+		while (count--)
+			*data++ = midi->control[cc++];
+	}
+}
@@ -25,6 +25,19 @@
 #define MIDI_GATE_ON_BIT   (1 << 0)
 #define MIDI_GATE_TRIG_BIT (1 << 1)
 
+//! One bit per voice - the narrowest type that fits all voices
+#if MIDI_MAX_VOICES <= 8
+typedef uint8_t midi_voice_mask;
+#elif MIDI_MAX_VOICES <= 16
+typedef uint16_t midi_voice_mask;
+#elif MIDI_MAX_VOICES <= 32
+typedef uint32_t midi_voice_mask;
+#elif MIDI_MAX_VOICES <= 64
+typedef uint64_t midi_voice_mask;
+#else
+#error MIDI_MAX_VOICES must not exceed 64
+#endif
+
 // Program data macros
 #define MIDI_PARAM_PROGRAM_BEGIN     0xff
 #define MIDI_PARAM_PROGRAM_TABLE_END 0xfe
@@ -32,6 +45,31 @@
 #define MIDI_PROGRAM_TABLE_END() {MIDI_PARAM_PROGRAM_TABLE_END, 0}
 #define MIDI_BOTH (1 << 7)
 
+/*
+	SysEx messages - manufacturer ID (non-commercial) and types
+
+		F0 7D 03 [value] x MIDI_PATCH_SIZE F7    patch dump
+		F0 7D 04 F7                              patch dump request
+
+	A patch dump carries every controller of the sound, in the order of
+	midi_patch_ranges. It's applied only once it has been received
+	whole, so the sound changes at once. A request is answered with a
+	dump of the patch at the time of the request, which can be sent back
+	to load it.
+*/
+#define MIDI_SYSEX_ID            0x7d
+#define MIDI_SYSEX_PATCH         3
+#define MIDI_SYSEX_PATCH_REQUEST 4
+#define MIDI_SYSEX_IGNORE        0xff //!< sysex_pos of a message that isn't ours or is broken
+#define MIDI_PATCH_SIZE          41
+
+//! Consecutive controllers stored in a patch dump
+typedef struct midi_patch_range
+{
+	uint8_t first;
+	uint8_t count;
+} midi_patch_range;
+
 typedef struct midi_program_data
 {
 	uint8_t param;
@@ -42,7 +80,6 @@ typedef struct midi_voice
 {
 	uint8_t note;
 	uint8_t velocity;
-	uint8_t gate;
 	int8_t age;
 } midi_voice;
 
@@ -50,11 +87,16 @@ typedef struct midi_status
 {
 	// MIDI controllers
 	uint8_t control[128];
+	uint8_t control_dirty[16]; //!< One bit per controller changed since the synth last used it
 
 	// Per voice controls
 	midi_voice voices[MIDI_MAX_VOICES];
 	uint8_t voice_count;
 
+	// Bit i is set if voice i is on / has been triggered since the last control cycle
+	midi_voice_mask gate_mask;
+	midi_voice_mask trig_mask;
+
 	// Internal state of the interpreter
 	uint8_t dlim;
 	uint8_t dcnt;
@@ -62,6 +104,12 @@ typedef struct midi_status
 	uint8_t channel;
 	uint8_t dbuf[4];
 
+	// SysEx being received
+	uint8_t sysex_pos;          //!< Data bytes received or MIDI_SYSEX_IGNORE
+	uint8_t sysex_type;
+	uint8_t sysex_data[MIDI_PATCH_SIZE];
+	uint8_t patch_request;      //!< Patch dump has been requested
+
 	// Basic MIDI controls
 	uint8_t program;
 	uint16_t pitchbend;
@@ -70,6 +118,8 @@ typedef struct midi_status
 
 extern void midi_init(midi_status *midi, uint8_t voice_count);
 extern void midi_program_load(midi_status *midi, uint8_t id);
+extern void midi_patch_load(midi_status *midi, const uint8_t *data);
+extern void midi_patch_store(const midi_status *midi, uint8_t *data);
 
 
 /**
@@ -86,11 +136,12 @@ static inline void midi_note_on(midi_status *midi, uint8_t note, uint8_t velocit
 	int8_t best_empty = MIDI_WORST_AGE;
 	int8_t best_active = MIDI_WORST_AGE;
 
-	for (uint8_t i = 0; i < midi->voice_count; i++)
+	midi_voice_mask bit = 1;
+	for (uint8_t i = 0; i < midi->voice_count; i++, bit <<= 1)
 	{
 		int8_t age = midi->voices[i].age;
 
-		if (midi->voices[i].gate)
+		if (midi->gate_mask & bit)
 		{
 			if (MIDI_AGE_COMP(age, best_active))
 			{
@@ -114,7 +165,8 @@ static inline void midi_note_on(midi_status *midi, uint8_t note, uint8_t velocit
 
 	// Always prefer empty slot over reuse
 	uint8_t slot = best_empty_slot == MIDI_MAX_VOICES ? best_active_slot : best_empty_slot;
-	midi->voices[slot].gate = MIDI_GATE_ON_BIT | MIDI_GATE_TRIG_BIT;
+	midi->gate_mask |= (midi_voice_mask) 1 << slot;
+	midi->trig_mask |= (midi_voice_mask) 1 << slot;
 	midi->voices[slot].note = note;
 	midi->voices[slot].velocity = velocity;
 	midi->voices[slot].age = 0;	
@@ -126,35 +178,129 @@ static inline void midi_note_on(midi_status *midi, uint8_t note, uint8_t velocit
 static inline void midi_note_off(midi_status *midi, uint8_t note) __attribute__((always_inline));
 static inline void midi_note_off(midi_status *midi, uint8_t note)
 {
-	for (uint8_t i = 0; i < MIDI_MAX_VOICES; i++)
+	midi_voice_mask off = 0;
+	midi_voice_mask bit = 1;
+	for (uint8_t i = 0; i < MIDI_MAX_VOICES; i++, bit <<= 1)
 		if (midi->voices[i].note == note)
-			midi->voices[i].gate = 0;
+			off |= bit;
+
+	midi->gate_mask &= ~off;
+	midi->trig_mask &= ~off;
+}
+
+/**
+	Sets a controller - it's marked as changed only if the value differs,
+	so the voices don't recompute what a program change or a controller
+	sending the same value again leaves as it was
+*/
+static inline void midi_control_set(midi_status *midi, uint8_t cc, uint8_t value)
+{
+	if (midi->control[cc] != value)
+	{
+		midi->control[cc] = value;
+		midi->control_dirty[cc >> 3] |= 1 << (cc & 7);
+	}
+}
+
+/**
+	Collects data bytes of a SysEx message
+*/
+static inline void midi_sysex_byte(midi_status *midi, uint8_t byte)
+{
+	uint8_t pos = midi->sysex_pos;
+
+	if (pos == MIDI_SYSEX_IGNORE)
+		return;
+	else if (pos == 0 && byte != MIDI_SYSEX_ID)
+		pos = MIDI_SYSEX_IGNORE - 1;
+	else if (pos == 1)
+		midi->sysex_type = byte;
+	else if (pos >= 2)
+	{
+		// Anything longer than a patch dump is broken
+		if (midi->sysex_type == MIDI_SYSEX_PATCH && pos - 2 < MIDI_PATCH_SIZE)
+			midi->sysex_data[pos - 2] = byte;
+		else
+			pos = MIDI_SYSEX_IGNORE - 1;
+	}
+
+	midi->sysex_pos = pos + 1;
 }
 
-static inline void midi_process_byte(midi_status *midi, uint8_t byte, uint8_t channel)
+/**
+	Handles end of a SysEx message
+
+	\returns 1 if a patch has been loaded
+*/
+static inline uint8_t midi_sysex_end(midi_status *midi)
+{
+	uint8_t pos = midi->sysex_pos;
+
+	if (midi->sysex_type == MIDI_SYSEX_PATCH && pos == 2 + MIDI_PATCH_SIZE)
+	{
+		midi_patch_load(midi, midi->sysex_data);
+		return 1;
+	}
+
+	if (midi->sysex_type == MIDI_SYSEX_PATCH_REQUEST && pos == 2)
+		midi->patch_request = 1;
+	return 0;
+}
+
+/**
+	Parses one MIDI byte and applies the message it completes
+
+	\returns 1 if the byte completed a note, a program change or a patch
+		dump, which take real work, 0 otherwise (status bytes, controller and pitch changes
+		only store a value)
+*/
+static inline uint8_t midi_process_byte(midi_status *midi, uint8_t byte, uint8_t channel)
 {
+	uint8_t heavy = 0;
 	uint8_t dlim = midi->dlim;
 	uint8_t dcnt = midi->dcnt;
 	uint8_t status = midi->status;
 
 	if (byte & (1 << 7)) // Handle status bytes
 	{
+		// Real-time messages may appear anywhere, even inside SysEx
+		if (byte >= 0xf8)
+			return 0;
+
+		// Any status byte ends SysEx, but only F7 completes it
+		if (status == 0x70 && midi->sysex_pos != MIDI_SYSEX_IGNORE)
+		{
+			if (byte == 0xf7)
+				heavy = midi_sysex_end(midi);
+			midi->sysex_pos = MIDI_SYSEX_IGNORE;
+		}
+
 		// Extract information from status byte
 		status = byte & 0x70;
 		midi->channel = byte & 0x0f;
+		if (byte == 0xf0)
+			midi->sysex_pos = 0;
 
+		// Aftertouch and channel pressure are ignored, but they
+		// must be parsed, so their data isn't taken for anything else
 		const static uint8_t dlim_table[16] __attribute__((aligned(16))) = 
 		{
 			[0] = 2, // Note off
 			[1] = 2, // Note on
+			[2] = 2, // Aftertouch
 			[3] = 2, // CC change
 			[4] = 1, // Program change
+			[5] = 1, // Channel pressure
 			[6] = 2, // Pitch change
 		};
 
 		dcnt = 0;
 		dlim = dlim_table[status >> 4];
 	}
+	else if (status == 0x70) // SysEx data - system common messages have nothing for us
+	{
+		midi_sysex_byte(midi, byte);
+	}
 	else if (midi->channel == channel) // Handle data bytes
 	{
 		// Data byte
@@ -168,21 +314,24 @@ static inline void midi_process_byte(midi_status *midi, uint8_t byte, uint8_t ch
 				// Note on
 				case 0x10:
 					midi_note_on(midi, midi->dbuf[0], midi->dbuf[1]);
+					heavy = 1;
 					break;
 
 				// Note off
 				case 0x00:
 					midi_note_off(midi, midi->dbuf[0]);
+					heavy = 1;
 					break;
 
 				// Controller change
 				case 0x30:
-					midi->control[midi->dbuf[0]] = midi->dbuf[1];
+					midi_control_set(midi, midi->dbuf[0], midi->dbuf[1]);
 					break;
 
 				// Program change
 				case 0x40:
 					midi_program_load(midi, midi->dbuf[0]);
+					heavy = 1;
 					break;
 
 				// Pitch
@@ -200,12 +349,28 @@ static inline void midi_process_byte(midi_status *midi, uint8_t byte, uint8_t ch
 	midi->dlim = dlim;
 	midi->dcnt = dcnt;
 	midi->status = status;
+	return heavy;
+}
+
+//! Checks if the byte would complete a program change or a patch dump - see midi_process_byte()
+static inline uint8_t midi_byte_loads_program(const midi_status *midi, uint8_t byte, uint8_t channel)
+{
+	if (byte == 0xf7)
+		return midi->status == 0x70 && midi->sysex_type == MIDI_SYSEX_PATCH && midi->sysex_pos == 2 + MIDI_PATCH_SIZE;
+
+	return !(byte & (1 << 7)) && midi->channel == channel && midi->status == 0x40 && midi->dcnt + 1 == midi->dlim;
 }
 
 static inline void midi_clear_trig_bits(midi_status *midi)
 {
-	for (uint8_t i = 0; i < MIDI_MAX_VOICES; i++)
-		midi->voices[i].gate &= ~MIDI_GATE_TRIG_BIT;
+	midi->trig_mask = 0;
+}
+
+//! Returns gate state of a voice - MIDI_GATE_ON_BIT and MIDI_GATE_TRIG_BIT
+static inline uint8_t midi_voice_gate(const midi_status *midi, uint8_t i)
+{
+	midi_voice_mask bit = (midi_voice_mask) 1 << i;
+	return ((midi->gate_mask & bit) ? MIDI_GATE_ON_BIT : 0) | ((midi->trig_mask & bit) ? MIDI_GATE_TRIG_BIT : 0);
 }
 
 #endif
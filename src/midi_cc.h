@@ -42,6 +42,8 @@
 #define MIDI_CLUSTER_SIZE       104  // Size of the synthesizer cluster
 #define MIDI_CLUSTER_ID         105  // Position in cluster
 #define MIDI_PING               106
+#define MIDI_PROFILE            107  // Requests load balancer profile report
+#define MIDI_HEALTH             108  // Requests MIDI input health report
 
 // Debug
 #define MIDI_DEBUG_CHANNEL      111
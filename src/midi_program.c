@@ -1,19 +1,14 @@
 #include "midi_program.h"
-#include <avr/pgmspace.h>
+#include "hal.h"
 #include "midi.h"
 #include "midi_cc.h"
 
 /**
-	Default MIDI programs
-
-	\warning These MIDI programs cannot set CC 127 and 126,
-	because those are reserved for MIDI_PROGRAM_BEGIN
-	and MIDI_PROGRAM_TABLE_END
+	Defaults - loaded when the requested program doesn't exist.
+	The presets in midi_program_table already contain them.
 */
-const midi_program_data midi_program_table[] PROGMEM =
+const midi_program_data midi_program_defaults[] PROGMEM =
 {
-	// The defaults loaded before loading any program
-	MIDI_PROGRAM_BEGIN(0xff),
 	{MIDI_BOTH | MIDI_OSC_WAVETABLE(0),    0  },
 	{MIDI_BOTH | MIDI_OSC_BASE_WAVE(0),    64 },
 	{MIDI_BOTH | MIDI_OSC_DETUNE(0),       64 },
@@ -42,8 +37,28 @@ const midi_program_data midi_program_table[] PROGMEM =
 	{MIDI_POLY,      1 },
 	{MIDI_CUTOFF,    64},
 
+	MIDI_PROGRAM_TABLE_END(),
+};
+
+/**
+	Presets, numbered from 1 - each one is merged with the defaults
+	by the preset build (see data/presets)
+
+	\warning These MIDI programs cannot set CC 127 and 126,
+	because those are reserved for MIDI_PROGRAM_BEGIN
+	and MIDI_PROGRAM_TABLE_END
+*/
+const midi_program_data midi_program_table[] PROGMEM =
+{
 #include "data/presets/generated.h"
 
 	MIDI_PROGRAM_TABLE_END(),
 };
 
+//! Offset of the first entry of each preset in midi_program_table
+const uint16_t midi_program_index[] PROGMEM =
+{
+#include "data/presets/generated_index.h"
+};
+
+const uint8_t midi_program_count PROGMEM = sizeof(midi_program_index) / sizeof(midi_program_index[0]);
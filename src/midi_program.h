@@ -1,9 +1,12 @@
 #ifndef MIDI_PROGRAM_H
 #define MIDI_PROGRAM_H
 
-#include <avr/pgmspace.h>
+#include "hal.h"
 #include "midi.h"
 
+extern const midi_program_data midi_program_defaults[] PROGMEM;
 extern const midi_program_data midi_program_table[] PROGMEM;
+extern const uint16_t midi_program_index[] PROGMEM;
+extern const uint8_t midi_program_count PROGMEM;
 
 #endif
\ No newline at end of file
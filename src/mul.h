@@ -5,8 +5,15 @@
 	\file Inline assmebly for integer multiplication
 
 	Based on Norbert Pozar's https://github.com/rekka/avrmultiplication
+
+	When not building for AVR, equivalent C code is used instead.
+	All variants return exactly the high part of the full product.
 */
 
+#include <inttypes.h>
+
+#ifdef __AVR__
+
 #define MUL_U16_U16_16H(intRes, intIn1, intIn2) \
 asm volatile ( \
 "clr r26 \n\t" \
@@ -76,6 +83,20 @@ asm volatile ( \
 "r26"\
 )
 
+#else
+
+//! (uint16_t * uint16_t) >> 16
+#define MUL_U16_U16_16H(intRes, intIn1, intIn2) \
+((intRes) = (uint16_t)(((uint32_t)(uint16_t)(intIn1) * (uint16_t)(intIn2)) >> 16))
+
+//! (int16_t * uint16_t) >> 16, rounded towards negative infinity
+#define MUL_S16_U16_16H(intRes, intIn1, intIn2) \
+((intRes) = (int16_t)(((int32_t)(int16_t)(intIn1) * (int32_t)(uint16_t)(intIn2)) >> 16))
+
+//! (uint16_t * uint8_t) >> 8
+#define MUL_U16_U8_16H(intRes, int16In, int8In) \
+((intRes) = (uint16_t)(((uint32_t)(uint16_t)(int16In) * (uint8_t)(int8In)) >> 8))
 
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -1,82 +1,135 @@
 #include "ppg.h"
 #include <inttypes.h>
-#include <string.h>
-#include <avr/pgmspace.h>
-#include <avr/eeprom.h>
+#include "../hal.h"
 
 /**
-	Load a wavetable stored in PPG Wave 2.2 format into an array of wavetable_entry structs of size wavetable_size
-	Returns a pointer to the next wavetable
+	Starts loading n-th wavetable stored in PPG Wave 2.2 format into an array
+	of wavetable_entry structs of size wavetable_size. The wavetable is ready
+	once ppg_wavetable_loader_step() returns 0.
+
+	Key-waves are read from EEPROM one by one and the entries between
+	each pair of them are interpolated. A key-wave beyond the wavetable
+	size is ignored - the last entries repeat the previous key-wave then.
 */
-const uint8_t *ppg_load_wavetable(ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data)
+void ppg_wavetable_loader_start(ppg_wavetable_loader *loader, ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data, uint8_t index)
 {
-	// Wipe the wavetable
-	memset(entries, 0, wavetable_size * sizeof(ppg_wavetable_entry));
+	uint16_t offset = eeprom_read_word(&ppg_wavetable_offsets[index]);
 
 	// The fist byte is ignored
-	data++;
+	data += offset + 1;
 
-	// Read wavetable entries up to size - 1
-	uint8_t waveform, pos;
-	do
-	{
-		waveform = eeprom_read_byte(data++);
-		pos = eeprom_read_byte(data++);
+	uint8_t waveform = eeprom_read_byte(data++);
+	loader->key_pos = eeprom_read_byte(data++);
+	loader->wave_l = loader->wave_r = waveform;
+	loader->factor_step = 0;
+	loader->factor = 0;
+	loader->pos = 0;
+	loader->entries = entries;
+	loader->data = data;
+	loader->size = wavetable_size;
+	loader->index = index;
+}
 
-		entries[pos].ptr_l = ppg_get_waveform_pointer(waveform);
-		entries[pos].ptr_r = NULL;
-		entries[pos].factor = 0;
-		entries[pos].is_key = 1;
-	}
-	while (pos < wavetable_size - 1);
+/**
+	Performs one loading step - either reads the next key-wave or
+	generates up to PPG_LOADER_ENTRIES_PER_STEP entries
 
-	// Now, generate interpolation coefficients
-	const ppg_wavetable_entry *el = NULL, *er = NULL;
-	for (uint8_t i = 0; i < wavetable_size; i++)
+	\returns 0 when the wavetable is complete
+*/
+uint8_t ppg_wavetable_loader_step(ppg_wavetable_loader *loader)
+{
+	// Interpolate entries up to the right key-wave
+	if (loader->pos < loader->key_pos)
 	{
-		// If the current entry contains a key-wave
-		if (entries[i].is_key)
+		uint8_t n = PPG_LOADER_ENTRIES_PER_STEP;
+		do
 		{
-			// Write both pointers in case the right key waveform is not found
-			el = er = &entries[i];
-
-			// Look for the next key-wave
-			for (uint8_t j = i + 1; j < wavetable_size; j++)
-			{
-				if (entries[j].is_key)
-				{
-					er = &entries[j];
-					break;
-				}
-			}
+			ppg_wavetable_entry *e = &loader->entries[loader->pos];
+			e->wave_l = loader->wave_l;
+			e->wave_r = loader->wave_r;
+			e->factor = loader->factor >> 8;
+			loader->factor += loader->factor_step;
 		}
+		while (++loader->pos < loader->key_pos && --n);
 
-		// Total distance between known key-waves and distance from the left one
-		uint8_t distance_total = er - el;
-		uint8_t distance_l = &entries[i] - el;
+		return 1;
+	}
 
-		entries[i].ptr_l = el->ptr_l;
-		entries[i].ptr_r = er->ptr_l;
+	// The last entry has no right neighbor
+	if (loader->key_pos >= loader->size - 1)
+	{
+		ppg_wavetable_entry *e = &loader->entries[loader->size - 1];
+		e->wave_l = e->wave_r = loader->wave_r;
+		e->factor = 0;
+		return 0;
+	}
 
-		// We have to avoid division by 0 for the last slot
-		if (distance_total != 0)
-			entries[i].factor = (65535 / distance_total * distance_l) >> 8;
-		else
-			entries[i].factor = 0;
+	// Read the next key-wave
+	uint8_t waveform = eeprom_read_byte(loader->data++);
+	uint8_t key_pos = eeprom_read_byte(loader->data++);
+	loader->wave_l = loader->wave_r;
+	loader->factor = 0;
+
+	if (key_pos < loader->size)
+	{
+		// Same as 65535 / distance_total * distance_l, but accumulated
+		uint8_t distance_total = key_pos - loader->key_pos;
+		loader->wave_r = waveform;
+		loader->factor_step = distance_total ? 65535u / distance_total : 0;
+		loader->key_pos = key_pos;
+	}
+	else
+	{
+		loader->factor_step = 0;
+		loader->key_pos = loader->size - 1;
 	}
 
-	// Return pointer to the next wavetable
-	return data;
+	return 1;
 }
 
-//! Loads n-th requested wavetable from binary format
-//! \see load_wavetable()
-const uint8_t *ppg_load_wavetable_n(ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data, uint8_t index)
+/**
+	Loads n-th wavetable at once
+	\see ppg_wavetable_loader_start()
+*/
+void ppg_load_wavetable_n(ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data, uint8_t index)
 {
-	uint16_t offset = eeprom_read_word(&ppg_wavetable_offsets[index]);
-	ppg_load_wavetable(entries, wavetable_size, data + offset);
-	return data;
+	ppg_wavetable_loader loader;
+	ppg_wavetable_loader_start(&loader, entries, wavetable_size, data, index);
+	while (ppg_wavetable_loader_step(&loader));
 }
 
+#ifdef PPG_WAVE_CACHE
+static uint16_t ppg_wave_cache[PPG_WAVETABLE_COUNT][PPG_DEFAULT_WAVETABLE_SIZE][128];
+static uint8_t ppg_wave_cache_ready;
+
+/**
+	Renders full 128-sample cycles of every wave of every wavetable
+	(about 450 kB). Only the first call does anything.
+*/
+void ppg_wave_cache_init(void)
+{
+	if (ppg_wave_cache_ready)
+		return;
+
+	ppg_wavetable_entry entries[PPG_DEFAULT_WAVETABLE_SIZE];
+	for (uint8_t t = 0; t < PPG_WAVETABLE_COUNT; t++)
+	{
+		ppg_load_wavetable_n(entries, PPG_DEFAULT_WAVETABLE_SIZE, ppg_wavetable_data, t);
+		for (uint8_t w = 0; w < PPG_DEFAULT_WAVETABLE_SIZE; w++)
+			for (uint8_t i = 0; i < 128; i++)
+				ppg_wave_cache[t][w][i] = ppg_get_wavetable_sample(
+					ppg_get_waveform_pointer(entries[w].wave_l),
+					ppg_get_waveform_pointer(entries[w].wave_r),
+					entries[w].factor,
+					(uint16_t) i << 9);
+	}
 
+	ppg_wave_cache_ready = 1;
+}
 
+//! Returns cached cycle of given wave, indexed with the top 7 bits of the phase
+const uint16_t *ppg_wave_cache_get(uint8_t wavetable, uint8_t wave)
+{
+	return ppg_wave_cache[wavetable][wave];
+}
+#endif
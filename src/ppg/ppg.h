@@ -1,23 +1,45 @@
 #ifndef PPG_H
 #define PPG_H
 
-#include <avr/pgmspace.h>
+#include "../hal.h"
 #include <inttypes.h>
 #include "ppg_data.h"
 
 //! This would be 64, but we don't need the additional 3 waveforms that PPG provides
 #define PPG_DEFAULT_WAVETABLE_SIZE 61
 
-//! Contains currently used wavetable
+//! Number of wavetable entries generated by one loader step
+#define PPG_LOADER_ENTRIES_PER_STEP 8
+
+/**
+	Contains currently used wavetable - waveform indices (see ppg_get_waveform_pointer())
+	of the two key-waves and the interpolation factor between them
+*/
 typedef struct ppg_wavetable_entry
 {
-	const uint8_t *ptr_l;
-	const uint8_t *ptr_r;
+	uint8_t wave_l;
+	uint8_t wave_r;
 	uint8_t factor;
-	uint8_t is_key;
-	uint16_t _padding;
 } ppg_wavetable_entry;
 
+/**
+	Incremental wavetable loader - builds a wavetable in a series of
+	ppg_wavetable_loader_step() calls, each of bounded cost
+*/
+typedef struct ppg_wavetable_loader
+{
+	ppg_wavetable_entry *entries;
+	const uint8_t *data;  //!< Next key-wave in EEPROM
+	uint8_t wave_l;       //!< Left key-wave
+	uint8_t wave_r;       //!< Right key-wave
+	uint16_t factor_step;
+	uint16_t factor;      //!< Interpolation factor (8.8)
+	uint8_t pos;          //!< Next entry to be generated
+	uint8_t key_pos;      //!< Position of the right key-wave
+	uint8_t size;
+	uint8_t index;        //!< Number of the wavetable being loaded
+} ppg_wavetable_loader;
+
 //! Returns a pointer to the wave with certain index (that can later be passed to get_waveform_sample())
 static inline const uint8_t *ppg_get_waveform_pointer(uint8_t index)
 {
@@ -45,18 +67,23 @@ static inline uint8_t ppg_get_waveform_sample_by_phase(const uint8_t *ptr, uint1
 		return 255u - ppg_get_waveform_sample(ptr, 63u - phase);
 }
 
-//! Reads a single sample based on a wavetable entry
-static inline uint16_t ppg_get_wavetable_sample(const ppg_wavetable_entry *e, uint16_t phase2b)
+//! Reads a single sample interpolated between two waveforms
+static inline uint16_t ppg_get_wavetable_sample(const uint8_t *ptr_l, const uint8_t *ptr_r, uint8_t factor, uint16_t phase2b)
 {
-	uint8_t sample_l = ppg_get_waveform_sample_by_phase(e->ptr_l, phase2b);
-	uint8_t sample_r = ppg_get_waveform_sample_by_phase(e->ptr_r, phase2b);
-	uint8_t factor = e->factor;
+	uint8_t sample_l = ppg_get_waveform_sample_by_phase(ptr_l, phase2b);
+	uint8_t sample_r = ppg_get_waveform_sample_by_phase(ptr_r, phase2b);
 	uint16_t mix_l = (256 - factor) * sample_l;
 	uint16_t mix_r = factor * sample_r;
 	return mix_l + mix_r;
 }
 
-extern const uint8_t *ppg_load_wavetable(ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data);
-extern const uint8_t *ppg_load_wavetable_n(ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data, uint8_t index);
+#ifdef PPG_WAVE_CACHE
+extern void ppg_wave_cache_init(void);
+extern const uint16_t *ppg_wave_cache_get(uint8_t wavetable, uint8_t wave);
+#endif
+
+extern void ppg_wavetable_loader_start(ppg_wavetable_loader *loader, ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data, uint8_t index);
+extern uint8_t ppg_wavetable_loader_step(ppg_wavetable_loader *loader);
+extern void ppg_load_wavetable_n(ppg_wavetable_entry *entries, uint8_t wavetable_size, const uint8_t *data, uint8_t index);
 
 #endif
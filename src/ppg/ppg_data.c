@@ -1,6 +1,5 @@
 #include <inttypes.h>
-#include <avr/pgmspace.h>
-#include <avr/eeprom.h>
+#include "../hal.h"
 #include "ppg_data.h"
 
 const uint16_t ppg_wavetable_offsets[PPG_WAVETABLE_COUNT] EEMEM = {
@@ -2,8 +2,7 @@
 #define PPG_DATA_AVR_H
 
 #include <inttypes.h>
-#include <avr/pgmspace.h>
-#include <avr/eeprom.h>
+#include "../hal.h"
 
 #define PPG_WAVETABLE_COUNT 29
 
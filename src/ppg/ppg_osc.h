@@ -4,9 +4,29 @@
 #include "ppg.h"
 #include "ppg_data.h"
 
+/*
+	With PPG_WAVE_CACHE the interpolation between the two key-waves is done
+	once for all waves, instead of every sample - the oscillator reads a
+	shared table with full cycles of all waves. The table takes about
+	450 kB, so the option is host-only.
+*/
+#if defined(PPG_WAVE_CACHE) && defined(__AVR__)
+#error PPG_WAVE_CACHE is host-only
+#endif
+
 typedef struct ppg_osc
 {
-	ppg_wavetable_entry wt[PPG_DEFAULT_WAVETABLE_SIZE];
+	ppg_wavetable_entry *wt; //!< PPG_DEFAULT_WAVETABLE_SIZE entries
+
+	// Current wavetable entry with waveform pointers resolved
+	const uint8_t *ptr_l;
+	const uint8_t *ptr_r;
+	uint8_t factor;
+
+#ifdef PPG_WAVE_CACHE
+	const uint16_t *cache; //!< Blended cycle
+	uint8_t wavetable;
+#endif
 
 	uint16_t phase;
 	uint16_t phase_step;
@@ -14,15 +34,48 @@ typedef struct ppg_osc
 	uint8_t wave;
 } ppg_osc;
 
+//! Selects wavetable entry - must be called whenever the wave or wavetable changes
+static inline void ppg_osc_set_wave(ppg_osc *osc, uint8_t wave)
+{
+	const ppg_wavetable_entry *e = &osc->wt[wave];
+	osc->wave = wave;
+	osc->ptr_l = ppg_get_waveform_pointer(e->wave_l);
+	osc->ptr_r = ppg_get_waveform_pointer(e->wave_r);
+	osc->factor = e->factor;
+
+#ifdef PPG_WAVE_CACHE
+	osc->cache = ppg_wave_cache_get(osc->wavetable, wave);
+#endif
+}
+
+//! Switches to another wavetable, e.g. one built by ppg_wavetable_loader
+static inline void ppg_osc_set_wavetable(ppg_osc *osc, ppg_wavetable_entry *wt, uint8_t index)
+{
+	osc->wt = wt;
+#ifdef PPG_WAVE_CACHE
+	osc->wavetable = index;
+#endif
+	ppg_osc_set_wave(osc, osc->wave);
+}
+
 static inline void ppg_osc_load_wavetable(ppg_osc *osc, uint8_t index)
 {
+#ifdef PPG_WAVE_CACHE
+	ppg_wave_cache_init();
+#endif
 	ppg_load_wavetable_n(osc->wt, PPG_DEFAULT_WAVETABLE_SIZE, ppg_wavetable_data, index);
+	ppg_osc_set_wavetable(osc, osc->wt, index);
 }
 
 static inline void ppg_osc_update(ppg_osc *osc)
 {
 	osc->phase += osc->phase_step;
-	osc->output = ppg_get_wavetable_sample(&osc->wt[osc->wave], osc->phase);
+
+#ifdef PPG_WAVE_CACHE
+	osc->output = osc->cache[osc->phase >> 9];
+#else
+	osc->output = ppg_get_wavetable_sample(osc->ptr_l, osc->ptr_r, osc->factor, osc->phase);
+#endif
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <inttypes.h>
+
+/**
+	\file Load balancer profiler
+
+	Enabled with USYNTH_PROFILE. The firmware records how many CPU cycles
+	were left in the sample period after each load balancer slot (0 means
+	the sample was late). A report is requested by setting MIDI_PROFILE
+	and is sent as a SysEx message:
+
+		F0 7D 01 [slot min_lo min_hi max_lo max_hi last_lo last_hi] x USYNTH_CONTROL_SLOTS F7
+
+	All values are split into 7-bit halves. The statistics are reset
+	once the report is sent.
+*/
+
+//! Headroom statistics of a single slot
+typedef struct usynth_slot_profile
+{
+	uint16_t min;
+	uint16_t max;
+	uint16_t last;
+} usynth_slot_profile;
+
+static inline void usynth_profile_reset(usynth_slot_profile *p, uint8_t slot_count)
+{
+	for (uint8_t i = 0; i < slot_count; i++)
+	{
+		p[i].min = UINT16_MAX;
+		p[i].max = 0;
+		p[i].last = 0;
+	}
+}
+
+static inline void usynth_profile_record(usynth_slot_profile *p, uint16_t headroom)
+{
+	if (headroom < p->min) p->min = headroom;
+	if (headroom > p->max) p->max = headroom;
+	p->last = headroom;
+}
+
+#endif
@@ -1,9 +1,9 @@
 #include "usynth.h"
-#include <avr/io.h>
-#include <avr/interrupt.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
 
+#include "hal.h"
 #include "utils.h"
 #include "mul.h"
 #include "midi.h"
@@ -16,96 +16,104 @@
 #include "data/notes_table.h"
 #include "data/env_table.h"
 
-#ifndef F_CPU
-#error F_CPU is not defined!
+// For mapping MIDI CC values to uint8_t and int8_t 
+#define MIDI_CTL(x) (synth->midi.control[(x)])
+#define MIDI_CTL_S8(x) (((int8_t)(MIDI_CTL((x))) - 64) << 1)
+#define MIDI_CTL_U8(x) ((MIDI_CTL((x))) << 1)
+#define MIDI_CTL_BOOL(x) (MIDI_CTL(x) != 0)
+#define MIDI_CTL_DIRTY(x) (synth->midi.control_dirty[(x) >> 3] & (1 << ((x) & 7)))
+
+#if MIDI_MAX_VOICES < USYNTH_VOICES
+#error MIDI_MAX_VOICES is lower than USYNTH_VOICES
 #endif
 
-#ifndef F_SAMPLE
-#error F_SAMPLE is not defined!
+/*
+	In poly mode each voice plays its own MIDI voice. In mono mode the voices
+	are paired - both voices of a pair play the same MIDI voice and each one
+	uses a different CC set. Both macros need poly_mode and midi_voice_offset.
+*/
+#define VOICE_CC_SET(i) (((i) & 1) && !poly_mode)
+#define VOICE_MIDI_VOICE(i) (midi_voice_offset + (poly_mode ? (i) : ((i) >> 1)))
+
+//! Number of MIDI voices handled by one chip
+#define USYNTH_MONO_VOICES ((USYNTH_VOICES + 1) / 2)
+
+//! The voice mix is scaled down by the next power of two
+#if USYNTH_VOICES == 2
+#define USYNTH_MIX_SHIFT 1
+#else
+#define USYNTH_MIX_SHIFT 2
 #endif
 
-#ifndef MIDI_BAUD
-#warning MIDI_BAUD is not defined! Assuming default 31250
-#define MIDI_BAUD 31250
+/*
+	EG and LFO steps are applied once per control cycle, which gets longer
+	with more voices. The steps are scaled so that the timing stays the same
+	as with 2 voices (21 sample cycle).
+*/
+#if USYNTH_CONTROL_SLOTS == 21
+#define CONTROL_RATE(x) (x)
+#else
+#define CONTROL_RATE_FACTOR ((USYNTH_CONTROL_SLOTS * 256UL + 10) / 21)
+#define CONTROL_RATE(x) control_rate_scale(x)
+static inline uint16_t control_rate_scale(uint16_t x)
+{
+	uint32_t y = ((uint32_t) x * CONTROL_RATE_FACTOR) >> 8;
+	return y > UINT16_MAX ? UINT16_MAX : y;
+}
 #endif
 
 /**
-	MIDI data ring buffer - written in interrupt, read in the main loop
+	Checks if any of the controllers voice_update_cc_1() uses has changed
 */
-static volatile uint8_t midi_buffer[256];
-static volatile uint8_t midi_wcnt = 0;
+static inline uint8_t voice_cc_1_dirty(usynth_instance *synth, uint8_t cc_set) __attribute__((always_inline));
+static inline uint8_t voice_cc_1_dirty(usynth_instance *synth, uint8_t cc_set)
+{
+	return MIDI_CTL_DIRTY(MIDI_OSC_BASE_WAVE(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_EG_MOD_INT(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_LFO_MOD_INT(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_AMP_A(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_AMP_S(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_AMP_R(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_AMP_ASR(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_EG_A(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_EG_S(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_EG_R(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_EG_ASR(cc_set));
+}
 
 /**
-	Main interrupt - sends a new sample to the DAC
+	Checks if any of the controllers voice_update_cc_2() uses has changed
+	- the wavetable is handled separately by voice_update_wavetable()
 */
-static volatile uint16_t dac_data = 0;
-static volatile uint8_t dac_sent = 0;
-ISR(TIMER1_COMPB_vect)
+static inline uint8_t voice_cc_2_dirty(usynth_instance *synth, uint8_t cc_set) __attribute__((always_inline));
+static inline uint8_t voice_cc_2_dirty(usynth_instance *synth, uint8_t cc_set)
 {
-	// CS is automatically set low, but LDAC needs to be forced high
-	TCCR1A |= (1 << COM1A0);
-	TCCR1C |= (1 << FOC1A);
-	TCCR1A &= ~(1 << COM1A1);
-
-	const uint16_t mcp4921_conf = MCP4921_SHDN_BIT | MCP4921_GAIN_BIT | MCP4921_VREF_BUF_BIT;
-	uint16_t data = mcp4921_conf | (dac_data >> 4);
-	
-	// Send the data via SPI
-	SPDR = data >> 8;
-	while (!(SPSR & (1 << SPIF)));
-	SPDR = data;
-	while (!(SPSR & (1 << SPIF)));
-	
-	// Force compare event to set CS high
-	TCCR1A |= (1 << COM1B0);
-	TCCR1C |= (1 << FOC1B);
-	TCCR1A &= ~(1 << COM1B1);
-	
-	// Check incoming USART data and buffer it
-	// No need for a while loop here - this interrupt
-	// is frequent enough
-	if (UCSR0A & (1 << RXC0))
-		midi_buffer[midi_wcnt++] = UDR0;
-
-	// Set sent flag, so the main loop can work again
-	dac_sent = 1;
+	return MIDI_CTL_DIRTY(MIDI_EG_PITCH_INT(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_LFO_PITCH_INT(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_LFO_RATE(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_LFO_WAVE(cc_set))
+		| MIDI_CTL_DIRTY(MIDI_LFO_FADE(cc_set));
 }
 
-// Synth globals
-static usynth_voice voices[2];
-static filter1pole filter;
-static int8_t filter_cutoff;
-
-// MIDI
-static midi_status midi;
-static uint8_t poly_mode = 1;
-static uint8_t midi_voice_offset = 0;
-
-// For mapping MIDI CC values to uint8_t and int8_t 
-#define MIDI_CTL(x) (midi.control[(x)])
-#define MIDI_CTL_S8(x) (((int8_t)(MIDI_CTL((x))) - 64) << 1)
-#define MIDI_CTL_U8(x) ((MIDI_CTL((x))) << 1)
-#define MIDI_CTL_BOOL(x) (MIDI_CTL(x) != 0)
-
 /**
 	Updates voice state based on MIDI control parameters (part 1)
 	\param cc_set determines from which MIDI CC set to update
 */
-static inline void voice_update_cc_1(usynth_voice *v, uint8_t cc_set) __attribute__((always_inline));
-static inline void voice_update_cc_1(usynth_voice *v, uint8_t cc_set)
+static inline void voice_update_cc_1(usynth_instance *synth, usynth_voice *v, uint8_t cc_set) __attribute__((always_inline));
+static inline void voice_update_cc_1(usynth_instance *synth, usynth_voice *v, uint8_t cc_set)
 {
 	v->base_wave = MIDI_CTL_S8(MIDI_OSC_BASE_WAVE(cc_set));
 	v->eg_mod_int = MIDI_CTL_S8(MIDI_EG_MOD_INT(cc_set));
 	v->lfo_mod_int = MIDI_CTL_S8(MIDI_LFO_MOD_INT(cc_set));
 
-	v->amp_eg.attack  = pgm_read_word(env_table + MIDI_CTL(MIDI_AMP_A(cc_set)));
+	v->amp_eg.attack  = CONTROL_RATE(pgm_read_word(env_table + MIDI_CTL(MIDI_AMP_A(cc_set))));
 	v->amp_eg.sustain = MIDI_CTL_U8(MIDI_AMP_S(cc_set));
-	v->amp_eg.release = pgm_read_word(env_table + MIDI_CTL(MIDI_AMP_R(cc_set)));
+	v->amp_eg.release = CONTROL_RATE(pgm_read_word(env_table + MIDI_CTL(MIDI_AMP_R(cc_set))));
 	v->amp_eg.sustain_enabled = MIDI_CTL(MIDI_AMP_ASR(cc_set));
 
-	v->mod_eg.attack  = pgm_read_word(env_table + MIDI_CTL(MIDI_EG_A(cc_set)));
+	v->mod_eg.attack  = CONTROL_RATE(pgm_read_word(env_table + MIDI_CTL(MIDI_EG_A(cc_set))));
 	v->mod_eg.sustain = MIDI_CTL_U8(MIDI_EG_S(cc_set));
-	v->mod_eg.release = pgm_read_word(env_table + MIDI_CTL(MIDI_EG_R(cc_set)));
+	v->mod_eg.release = CONTROL_RATE(pgm_read_word(env_table + MIDI_CTL(MIDI_EG_R(cc_set))));
 	v->mod_eg.sustain_enabled = MIDI_CTL(MIDI_EG_ASR(cc_set));
 }
 
@@ -113,17 +121,26 @@ static inline void voice_update_cc_1(usynth_voice *v, uint8_t cc_set)
 	Updates voice state based on MIDI control parameters (part 2)
 	\param cc_set determines from which MIDI CC set to update
 */
-static inline void voice_update_cc_2(usynth_voice *v, uint8_t cc_set)
+static inline void voice_update_cc_2(usynth_instance *synth, usynth_voice *v, uint8_t cc_set)
 {
 	v->eg_pitch_int = (int8_t)MIDI_CTL(MIDI_EG_PITCH_INT(cc_set)) - 64;
 	v->lfo_pitch_int = (int8_t)MIDI_CTL(MIDI_LFO_PITCH_INT(cc_set)) - 64;
 
-	v->lfo.step = MIDI_CTL_U8(MIDI_LFO_RATE(cc_set)) << 1;
+	v->lfo.step = CONTROL_RATE(MIDI_CTL_U8(MIDI_LFO_RATE(cc_set)) << 1);
 	v->lfo.waveform = MIDI_CTL(MIDI_LFO_WAVE(cc_set));
-	v->lfo.fade_step = pgm_read_word(env_table + MIDI_CTL(MIDI_LFO_FADE(cc_set)));
+	v->lfo.fade_step = CONTROL_RATE(pgm_read_word(env_table + MIDI_CTL(MIDI_LFO_FADE(cc_set))));
+}
 
-	// Loads wavetable when it changes
-	if (v->wavetable_number != MIDI_CTL(MIDI_OSC_WAVETABLE(cc_set)))
+/**
+	Checks voice's wavetable - runs every control cycle, because
+	a voice may have to wait for another one's wavetable to load
+	\param cc_set determines from which MIDI CC set to update
+*/
+static inline void voice_update_wavetable(usynth_instance *synth, usynth_voice *v, uint8_t cc_set)
+{
+	// Starts loading wavetable when it changes - if another one is being
+	// loaded, this voice has to wait until it's done
+	if (v->wavetable_number != MIDI_CTL(MIDI_OSC_WAVETABLE(cc_set)) && !synth->wavetable_load_voice)
 	{
 		v->wavetable_number = MIN(MIDI_CTL(MIDI_OSC_WAVETABLE(cc_set)), PPG_WAVETABLE_COUNT - 1);
 
@@ -131,7 +148,25 @@ static inline void voice_update_cc_2(usynth_voice *v, uint8_t cc_set)
 		// is not reloaded over and over if it's out of range
 		MIDI_CTL(MIDI_OSC_WAVETABLE(cc_set)) = v->wavetable_number;
 
-		ppg_osc_load_wavetable(&v->osc, v->wavetable_number);
+		ppg_wavetable_loader_start(&synth->wavetable_loader, synth->wavetable_loader.entries,
+			PPG_DEFAULT_WAVETABLE_SIZE, ppg_wavetable_data, v->wavetable_number);
+		synth->wavetable_load_voice = v;
+	}
+}
+
+/**
+	Does one step of the wavetable loading and when the new wavetable
+	is complete, swaps it with the one used by the voice
+*/
+static inline void update_wavetable_load(usynth_instance *synth)
+{
+	usynth_voice *v = synth->wavetable_load_voice;
+	if (v && !ppg_wavetable_loader_step(&synth->wavetable_loader))
+	{
+		ppg_wavetable_entry *wt = v->osc.wt;
+		ppg_osc_set_wavetable(&v->osc, synth->wavetable_loader.entries, synth->wavetable_loader.index);
+		synth->wavetable_loader.entries = wt;
+		synth->wavetable_load_voice = NULL;
 	}
 }
 
@@ -140,7 +175,7 @@ static inline void voice_update_cc_2(usynth_voice *v, uint8_t cc_set)
 	\param cc_set determines from which MIDI CC set to update
 	\param midi_voice determines polyphony voice ID to use
 */
-static inline void voice_update_gate(usynth_voice *v, uint8_t cc_set, uint8_t midi_gate)
+static inline void voice_update_gate(usynth_instance *synth, usynth_voice *v, uint8_t cc_set, uint8_t midi_gate)
 {
 	// Executed once on keypress
 	if (midi_gate & MIDI_GATE_TRIG_BIT)
@@ -170,12 +205,12 @@ static inline void voice_update_gate(usynth_voice *v, uint8_t cc_set, uint8_t mi
 	\param cc_set determines from which MIDI CC set to update
 	\param midi_voice determines polyphony voice ID to use
 */
-static inline void voice_update_note(usynth_voice *v, uint8_t cc_set, uint8_t midi_note) __attribute__((always_inline));
-static inline void voice_update_note(usynth_voice *v, uint8_t cc_set, uint8_t midi_note)
+static inline void voice_update_note(usynth_instance *synth, usynth_voice *v, uint8_t cc_set, uint8_t midi_note) __attribute__((always_inline));
+static inline void voice_update_note(usynth_instance *synth, usynth_voice *v, uint8_t cc_set, uint8_t midi_note)
 {
 	int16_t note = (int16_t)midi_note + MIDI_CTL(MIDI_OSC_PITCH(cc_set)) - 64 - 4; // Subtract 4 here intead of subtracting 128 later
 	note <<= 5; // Now we operate on 100/32 cents
-	note += (int16_t)(midi.pitchbend >> 7) + MIDI_CTL(MIDI_OSC_DETUNE(cc_set));
+	note += (int16_t)(synth->midi.pitchbend >> 7) + MIDI_CTL(MIDI_OSC_DETUNE(cc_set));
 	note += (v->eg_pitch_int * (int8_t)(v->mod_eg.output >> 9)) >> 3;
 	note += (v->lfo_pitch_int * (int8_t)(v->lfo.output >> 8)) >> 4;
 	
@@ -196,260 +231,397 @@ static inline void voice_update_mod(usynth_voice *v)
 
 	// The -128 - 127 range is mapped to 0 - 64
 	mod = 32 + (mod >> 2);
-	v->osc.wave = CLAMP(mod, 0, PPG_DEFAULT_WAVETABLE_SIZE - 1);
+	ppg_osc_set_wave(&v->osc, CLAMP(mod, 0, PPG_DEFAULT_WAVETABLE_SIZE - 1));
+}
+
+#ifdef USYNTH_PROFILE
+// The header, 7 bytes per slot and F7 must be counted by tx_pos without wrapping
+_Static_assert(3 + 7 * USYNTH_CONTROL_SLOTS + 1 <= (1UL << (8 * sizeof(((usynth_instance*) 0)->tx_pos))),
+	"Profile report is too long for tx_pos");
+
+/**
+	Returns n-th byte of the profile report (without the SysEx header)
+	\see profile.h
+*/
+static inline uint8_t usynth_profile_report_byte(usynth_instance *synth, uint16_t n)
+{
+	uint8_t slot = n / 7;
+	uint8_t field = n % 7;
+	if (slot >= USYNTH_CONTROL_SLOTS)
+		return 0xf7;
+	if (field == 0)
+		return slot;
+
+	const usynth_slot_profile *p = &synth->profile[slot];
+	field--;
+	uint16_t value = field < 2 ? p->min : (field < 4 ? p->max : p->last);
+	return (field & 1 ? value >> 7 : value) & 0x7f;
+}
+#endif
+
+/**
+	Returns n-th byte of the health report payload or 0xf7 past its end
+
+	\see health.h
+*/
+static inline uint8_t usynth_health_report_byte(usynth_instance *synth, uint16_t n)
+{
+	const usynth_health_counters *c = &synth->health_report;
+	const uint16_t values[] = {c->high_water, c->dropped_bytes, c->dropped_messages, c->late_samples};
+	if (n >= 2 * sizeof(values) / sizeof(values[0]))
+		return 0xf7;
+
+	uint16_t value = values[n >> 1];
+	return (n & 1 ? value >> 7 : value) & 0x7f;
+}
+
+/**
+	Transmits next byte of the current report
+*/
+static inline void usynth_report_tx(usynth_instance *synth)
+{
+	uint16_t pos = synth->tx_pos++;
+	uint8_t byte;
+
+	// SysEx header
+	if (pos == 0)
+		byte = 0xf0;
+	else if (pos == 1)
+		byte = USYNTH_SYSEX_ID;
+	else if (pos == 2)
+		byte = synth->tx_report;
+#ifdef USYNTH_PROFILE
+	else if (synth->tx_report == USYNTH_REPORT_PROFILE)
+		byte = usynth_profile_report_byte(synth, pos - 3);
+#endif
+	else if (synth->tx_report == USYNTH_REPORT_HEALTH)
+		byte = usynth_health_report_byte(synth, pos - 3);
+	else if (synth->tx_report == USYNTH_REPORT_PATCH && pos - 3 < MIDI_PATCH_SIZE)
+		byte = synth->patch_report[pos - 3];
+	else
+		byte = 0xf7;
+
+	hal_midi_tx(byte);
+
+	// Report done
+	if (byte == 0xf7)
+	{
+#ifdef USYNTH_PROFILE
+		if (synth->tx_report == USYNTH_REPORT_PROFILE)
+			usynth_profile_reset(synth->profile, USYNTH_CONTROL_SLOTS);
+#endif
+		synth->tx_report = USYNTH_REPORT_NONE;
+	}
 }
 
 /**
 	Updates global/common synth state
 */
-static inline void update_global_1(void)
+static inline void update_global_1(usynth_instance *synth)
 {
 	// Resets phase of all LFOs
 	if (MIDI_CTL(MIDI_LFO_RESET))
 	{
 		MIDI_CTL(MIDI_LFO_RESET) = 0;
-		usynth_lfo_sync(&voices[0].lfo);
-		usynth_lfo_sync(&voices[1].lfo);	
+		for (uint8_t i = 0; i < USYNTH_VOICES; i++)
+			usynth_lfo_sync(&synth->voices[i].lfo);
 	}
 
+	// Reports are sent one byte per control cycle, so the
+	// UART is always ready and the main loop never waits
+	if (synth->tx_report)
+	{
+		if (hal_midi_tx_ready())
+			usynth_report_tx(synth);
+	}
 	// Handle ping requests
-	if (MIDI_CTL(MIDI_PING))
+	else if (MIDI_CTL(MIDI_PING))
 	{
 		// Transmit one byte of ping response
-		while (!(UCSR0A & (1 << UDRE0)));
-		UDR0 = MIDI_CTL(MIDI_PING);
+		hal_midi_tx(MIDI_CTL(MIDI_PING));
 		MIDI_CTL(MIDI_PING) = 0;
 	}
+#ifdef USYNTH_PROFILE
+	// Handle profile report requests
+	else if (MIDI_CTL(MIDI_PROFILE))
+	{
+		synth->tx_report = USYNTH_REPORT_PROFILE;
+		synth->tx_pos = 0;
+		MIDI_CTL(MIDI_PROFILE) = 0;
+	}
+#endif
+	// Handle health report requests - the counters are taken
+	// and reset at once, the receive interrupt updates them
+	else if (MIDI_CTL(MIDI_HEALTH))
+	{
+		uint8_t irq = hal_irq_save();
+		synth->health_report = synth->midi_health.counters;
+		memset(&synth->midi_health.counters, 0, sizeof(synth->midi_health.counters));
+		hal_irq_restore(irq);
+
+		synth->tx_report = USYNTH_REPORT_HEALTH;
+		synth->tx_pos = 0;
+		MIDI_CTL(MIDI_HEALTH) = 0;
+	}
+	// Handle patch dump requests (SysEx) - the patch is taken at once,
+	// so controllers changing during the transfer don't mix into it
+	else if (synth->midi.patch_request)
+	{
+		midi_patch_store(&synth->midi, synth->patch_report);
+		synth->tx_report = USYNTH_REPORT_PATCH;
+		synth->tx_pos = 0;
+		synth->midi.patch_request = 0;
+	}
 
 	// Filter control
-	filter_cutoff = MIDI_CTL(MIDI_CUTOFF) >> 1;
+	synth->filter_cutoff = MIDI_CTL(MIDI_CUTOFF) >> 1;
 
 	// Clear 'triggered' gate bits
-	midi_clear_trig_bits(&midi);
+	midi_clear_trig_bits(&synth->midi);
 }
 
 /**
 	Updates global state - handles mono/poly switching and cluster operation
 */
-static inline void update_global_2(void)
+static inline void update_global_2(usynth_instance *synth)
 {
 	// Mono/poly and cluster logic
-	uint8_t cluster_size = CLAMP(MIDI_CTL(MIDI_CLUSTER_SIZE), 1, MIDI_MAX_VOICES / 2);
+	uint8_t cluster_size = CLAMP(MIDI_CTL(MIDI_CLUSTER_SIZE), 1, MIDI_MAX_VOICES / USYNTH_VOICES);
 	uint8_t cluster_id = MIN(MIDI_CTL(MIDI_CLUSTER_ID), cluster_size - 1);
-	poly_mode = MIDI_CTL(MIDI_POLY) != 0;
-	midi.voice_count = (poly_mode + 1) * cluster_size;
-	midi_voice_offset = (poly_mode + 1) * cluster_id;
-}
+	uint8_t poly_mode = MIDI_CTL(MIDI_POLY) != 0;
 
-int main(void)
-{
-	// LEDs
-	DDRD |= (1 << LED_1_PIN) | (1 << LED_2_PIN) | (1 << LED_3_PIN);
-	
-	// 10 MHz SPI Master, DAC IO
-	PORTB |= (1 << LDAC_PIN) | (1 << CS_PIN);
-	DDRB |= (1 << LDAC_PIN) | (1 << CS_PIN) | (1 << MOSI_PIN) | (1 << SCK_PIN);
-	SPCR = (1 << SPE) | (1 << MSTR);
-	SPSR = (1 << SPI2X);
-	
-	/*
-		TIMER 1 - CTC mode, F_CPU
+	// Voices switch CC sets - update all of them
+	if (poly_mode != synth->poly_mode)
+		memset(synth->midi.control_dirty, 0xff, sizeof(synth->midi.control_dirty));
 
-		- Clear OC1B (CS) on compare
-		- Clear OC1A (LDAC) on compare
-		- COMP1B ISR active
+	synth->poly_mode = poly_mode;
+	uint8_t chip_voices = synth->poly_mode ? USYNTH_VOICES : USYNTH_MONO_VOICES;
+	synth->midi.voice_count = chip_voices * cluster_size;
+	synth->midi_voice_offset = chip_voices * cluster_id;
+}
 
-		Event:    COMPB       FORCE
-		__   _______|    ISR    |__________
-		CS          |___________|
+/**
+	Resets synth state and loads the initial program
+*/
+void usynth_init(usynth_instance *synth)
+{
+	memset(synth, 0, sizeof(*synth));
+	synth->poly_mode = 1;
 
-		Event:      FORCE           COMPA
-		____          |_______________|
-		LDAC _________|               |____
-	*/
-	TCCR1A = (1 << COM1A1) | (1 << COM1B1);
-	TCCR1B = (1 << WGM12) | (1 << CS10);
-	TIMSK1 = (1 << OCIE1B);
- 	OCR1A = F_CPU / F_SAMPLE - 1;
- 	OCR1B = 4; // Determines LDAC pulse width (must be over 100ns)
-	
-	// USART0 - MIDI, 8 bit data, 1 bit stop, no parity
-	UBRR0 = F_CPU / 16 / MIDI_BAUD - 1;
-	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
-	UCSR0C = (1 << UCSZ00) | (1<< UCSZ01);
-	
-	// -------------- HW init done
+	// Start with a valid wavetable and force wavetable
+	// reload by storing a fake number
+	for (uint8_t i = 0; i < USYNTH_VOICES; i++)
+	{
+		synth->voices[i].osc.wt = synth->wavetables[i];
+		ppg_osc_load_wavetable(&synth->voices[i].osc, 0);
+		synth->voices[i].wavetable_number = 255;
+	}
+	synth->wavetable_loader.entries = synth->wavetables[USYNTH_VOICES];
 
-	// Force wavetable reload by storing a fake number
-	voices[0].wavetable_number = 255;
-	voices[1].wavetable_number = 255;
+#ifdef USYNTH_PROFILE
+	usynth_profile_reset(synth->profile, USYNTH_CONTROL_SLOTS);
+#endif
 
-	midi_init(&midi, 2);
-	midi_program_load(&midi, 0);
+	midi_init(&synth->midi, USYNTH_VOICES);
+	midi_program_load(&synth->midi, 0);
 	MIDI_CTL(MIDI_CLUSTER_SIZE) = 1;
 	MIDI_CTL(MIDI_CLUSTER_ID) = 0;
+}
+
+/**
+	Processes bytes waiting in the MIDI input buffer. A note or a program
+	change ends the burst.
 
-	sei();
+	\param limit maximum number of bytes to process
+	\param spare the slot has other work to do - stops before a program change
+		or a patch dump is loaded
+*/
+static inline void usynth_midi_drain(usynth_instance *synth, uint8_t limit, uint8_t spare)
+{
+	midi_status *midi = &synth->midi;
 
-	// The main loop
-	uint8_t load_balancer_cnt = 0;
-	uint8_t midi_rcnt = 0;
-	while (1)
+	for (uint8_t n = 0; n < limit && synth->midi_rcnt != synth->midi_wcnt; n++)
 	{
-		/*
-			Distribute workload evenly across each 21 samples
-			
-			31250 / 8 / 28000 * 20 = ~2.92 which means that reading
-			3 MIDI data bytes in the loop is sufficient
-		*/
-		switch (load_balancer_cnt++)
+		uint8_t byte = synth->midi_buffer[synth->midi_rcnt];
+		if (spare && midi_byte_loads_program(midi, byte, 0))
+			break;
+
+		synth->midi_rcnt++;
+		if (midi_process_byte(midi, byte, 0))
+			break;
+	}
+}
+
+/**
+	Does control work assigned to one slot of the 21 sample control cycle
+*/
+static inline void usynth_control_slot(usynth_instance *synth, uint8_t slot) __attribute__((always_inline));
+static inline void usynth_control_slot(usynth_instance *synth, uint8_t slot)
+{
+	usynth_voice *voices = synth->voices;
+	midi_status *midi = &synth->midi;
+	uint8_t poly_mode = synth->poly_mode;
+	uint8_t midi_voice_offset = synth->midi_voice_offset;
+
+	/*
+		Distribute workload evenly across the control cycle (see usynth.h)
+
+		31250 / 10 / 28000 * 21 = ~2.34 which means that reading
+		3 MIDI data bytes in the loop is sufficient for 2 voices.
+		Bursts and the spare slots clear any backlog much faster.
+	*/
+	switch (slot)
+	{
+		// Process MIDI bytes
+		case USYNTH_SLOT_MIDI ... USYNTH_SLOT_MIDI + USYNTH_MIDI_SLOTS - 1:
+			usynth_midi_drain(synth, USYNTH_MIDI_BURST, 0);
+			break;
+
+		// Update from MIDI (1/2 and 2/2 for each voice)
+		case USYNTH_SLOT_CC(0) ... USYNTH_SLOT_CC(USYNTH_VOICES) - 1:
 		{
-			// Process MIDI byte
-			case 0:
-				if (midi_rcnt != midi_wcnt) midi_process_byte(&midi, midi_buffer[midi_rcnt++], 0);
-				break;
-
-			// Process MIDI byte
-			case 1:
-				if (midi_rcnt != midi_wcnt) midi_process_byte(&midi, midi_buffer[midi_rcnt++], 0);
-				break;
-
-			// Process MIDI byte
-			case 2:
-				if (midi_rcnt != midi_wcnt) midi_process_byte(&midi, midi_buffer[midi_rcnt++], 0);
-				break;
-
-			// Update from MIDI (1/2) (Voice 0)
-			case 3:
-				voice_update_cc_1(&voices[0], 0);
-				break;
-
-			// Update from MIDI (2/2) (Voice 0)
-			case 4:
-				voice_update_cc_2(&voices[0], 0);
-				break;
-
-			// Update from MIDI (1/2) (Voice 1)
-			case 5:
-				if (poly_mode)
-					voice_update_cc_1(&voices[1], 0);
-				else
-					voice_update_cc_1(&voices[1], 1);
-				break;
-
-			// Update from MIDI (2/2) (Voice 1)
-			case 6:
-				voice_update_cc_2(&voices[1], !poly_mode);
-				break;
-
-			// Update control parameters 0, 1
-			case 7:
-				voice_update_gate(&voices[0], 0, midi.voices[midi_voice_offset].gate);
-				voice_update_gate(&voices[1], !poly_mode, midi.voices[midi_voice_offset + poly_mode].gate);
-				break;
-			
-			// Update frequency (Voice 1)
-			case 8:
-				voice_update_note(&voices[0], 0, midi.voices[midi_voice_offset].note);
-				break;
-
-			// Update frequency (Voice 2)
-			case 9:
-				if (poly_mode)
-					voice_update_note(&voices[1], 0, midi.voices[midi_voice_offset + poly_mode].note);
-				else
-					voice_update_note(&voices[1], 1, midi.voices[midi_voice_offset + poly_mode].note);
-				break;
-
-			// Update globals (1/2)
-			case 10:	
-				update_global_1();
-				break;
-
-			// Update globals (2/2)
-			case 11:
-				update_global_2();
-				break;
-				
-			// AMP EG 0
-			case 12:
-				usynth_eg_update(&voices[0].amp_eg);
-				break;
-
-			// AMP EG 1
-			case 13:
-				usynth_eg_update(&voices[1].amp_eg);
-				break;
-
-			// MOD EG 0 
-			case 14:
-				usynth_eg_update(&voices[0].mod_eg);
-				break;
-
-			// MOD EG 1
-			case 15:
-				usynth_eg_update(&voices[1].mod_eg);
-				break;
-
-			// LFO 0
-			case 16:
-				usynth_lfo_update(&voices[0].lfo);
-				break;
-
-			// LFO 1
-			case 17:
-				usynth_lfo_update(&voices[1].lfo);
-				break;
-
-			// Update modulation 0
-			case 18:
-				voice_update_mod(&voices[0]);
-				break;
-
-			// Update modulation 1
-			case 19:
-				voice_update_mod(&voices[1]);
-				break;
-
-			// LEDs and counter reset
-			case 20:
-				if (voices[0].amp_eg.output >> 8)
-					PORTD |= (1 << LED_RED_PIN);
-				else
-					PORTD &= ~(1 << LED_RED_PIN);
-
-				if (voices[1].amp_eg.output >> 8)
-					PORTD |= (1 << LED_YLW_PIN);
-				else
-					PORTD &= ~(1 << LED_YLW_PIN);
-
-				load_balancer_cnt = 0;
-				break;
+			uint8_t n = slot - USYNTH_SLOT_CC(0);
+			uint8_t i = n >> 1;
+			if (n & 1)
+			{
+				if (voice_cc_2_dirty(synth, VOICE_CC_SET(i)))
+					voice_update_cc_2(synth, &voices[i], VOICE_CC_SET(i));
+				voice_update_wavetable(synth, &voices[i], VOICE_CC_SET(i));
+			}
+			else if (voice_cc_1_dirty(synth, VOICE_CC_SET(i)))
+				voice_update_cc_1(synth, &voices[i], VOICE_CC_SET(i));
+
+			// All voices are up to date - MIDI slots come before these
+			if (slot == USYNTH_SLOT_CC(USYNTH_VOICES) - 1)
+				memset(midi->control_dirty, 0, sizeof(midi->control_dirty));
+			break;
 		}
 
-		ppg_osc_update(&voices[0].osc);
-		ppg_osc_update(&voices[1].osc);
+		// Update gates of all voices
+		case USYNTH_SLOT_GATES:
+			for (uint8_t i = 0; i < USYNTH_VOICES; i++)
+				voice_update_gate(synth, &voices[i], VOICE_CC_SET(i), midi_voice_gate(midi, VOICE_MIDI_VOICE(i)));
+			break;
+		
+		// Update frequency
+		case USYNTH_SLOT_NOTE(0) ... USYNTH_SLOT_NOTE(USYNTH_VOICES) - 1:
+		{
+			uint8_t i = slot - USYNTH_SLOT_NOTE(0);
+			voice_update_note(synth, &voices[i], VOICE_CC_SET(i), midi->voices[VOICE_MIDI_VOICE(i)].note);
+			break;
+		}
 
-		// Mixing
-		uint16_t x0, x1;
-		MUL_U16_U16_16H(x0, voices[0].osc.output, voices[0].amp_eg.output);
-		MUL_U16_U8_16H(x0, x0, midi.voices[midi_voice_offset].velocity << 1);
-		MUL_U16_U16_16H(x1, voices[1].osc.output, voices[1].amp_eg.output);
-		MUL_U16_U8_16H(x1, x1, midi.voices[midi_voice_offset + poly_mode].velocity << 1);
+		// Update globals (1/2)
+		case USYNTH_SLOT_GLOBAL:
+			update_global_1(synth);
+			break;
 
-		// Filter
-		int16_t x = (x0 >> 1) + (x1 >> 1) - 32768;
-		x = filter1pole_feed(&filter, filter_cutoff, x);
+		// Update globals (2/2) and load wavetable
+		case USYNTH_SLOT_GLOBAL + 1:
+			update_global_2(synth);
+			update_wavetable_load(synth);
+			break;
+			
+		// AMP EGs and MIDI backlog
+		case USYNTH_SLOT_AMP_EG(0) ... USYNTH_SLOT_AMP_EG(USYNTH_VOICES) - 1:
+			usynth_eg_update(&voices[slot - USYNTH_SLOT_AMP_EG(0)].amp_eg);
+			usynth_midi_drain(synth, USYNTH_MIDI_SPARE_BURST, 1);
+			break;
+
+		// MOD EGs and MIDI backlog
+		case USYNTH_SLOT_MOD_EG(0) ... USYNTH_SLOT_MOD_EG(USYNTH_VOICES) - 1:
+			usynth_eg_update(&voices[slot - USYNTH_SLOT_MOD_EG(0)].mod_eg);
+			usynth_midi_drain(synth, USYNTH_MIDI_SPARE_BURST, 1);
+			break;
+
+		// LFOs and MIDI backlog
+		case USYNTH_SLOT_LFO(0) ... USYNTH_SLOT_LFO(USYNTH_VOICES) - 1:
+			usynth_lfo_update(&voices[slot - USYNTH_SLOT_LFO(0)].lfo);
+			usynth_midi_drain(synth, USYNTH_MIDI_SPARE_BURST, 1);
+			break;
+
+		// Update modulation and MIDI backlog
+		case USYNTH_SLOT_MOD(0) ... USYNTH_SLOT_MOD(USYNTH_VOICES) - 1:
+			voice_update_mod(&voices[slot - USYNTH_SLOT_MOD(0)]);
+			usynth_midi_drain(synth, USYNTH_MIDI_SPARE_BURST, 1);
+			break;
+
+		// LEDs, wavetable loading and counter reset
+		case USYNTH_SLOT_LEDS:
+			hal_led_write(LED_RED_PIN, voices[0].amp_eg.output >> 8);
+			hal_led_write(LED_YLW_PIN, voices[1].amp_eg.output >> 8);
+			update_wavetable_load(synth);
+			synth->load_balancer_cnt = 0;
+			break;
+	}
+}
 
-		// Output sample
-		dac_data = x + 32768;
-		
-		// Wait for the 'sent' flag and clear it
-		while (!dac_sent)
+/**
+	Computes one signed output sample
+*/
+static inline int16_t usynth_sample(usynth_instance *synth) __attribute__((always_inline));
+static inline int16_t usynth_sample(usynth_instance *synth)
+{
+	usynth_voice *voices = synth->voices;
+	midi_status *midi = &synth->midi;
+	uint8_t poly_mode = synth->poly_mode;
+	uint8_t midi_voice_offset = synth->midi_voice_offset;
+
+	// Oscillators and mixing
+	uint16_t mix = 0;
+	for (uint8_t i = 0; i < USYNTH_VOICES; i++)
+	{
+		uint16_t x;
+		ppg_osc_update(&voices[i].osc);
+		MUL_U16_U16_16H(x, voices[i].osc.output, voices[i].amp_eg.output);
+		MUL_U16_U8_16H(x, x, midi->voices[VOICE_MIDI_VOICE(i)].velocity << 1);
+		mix += x >> USYNTH_MIX_SHIFT;
+	}
+
+	// Filter
+	int16_t x = mix - 32768;
+	return filter1pole_feed(&synth->filter, synth->filter_cutoff, x);
+}
+
+/**
+	Does one slot of control work and computes one output sample
+
+	\returns unsigned 16-bit sample
+*/
+uint16_t usynth_update(usynth_instance *synth)
+{
+	usynth_control_slot(synth, synth->load_balancer_cnt++);
+	return usynth_sample(synth) + 32768;
+}
+
+/**
+	Renders a block of signed samples
+
+	Produces exactly the same output as calling usynth_update() frames times.
+	Whole control cycles are unrolled, so each slot's work is inlined
+	in place and the per-sample dispatch goes away.
+*/
+void usynth_render(usynth_instance *synth, int16_t *out, size_t frames)
+{
+	while (frames)
+	{
+		if (synth->load_balancer_cnt == 0 && frames >= USYNTH_CONTROL_SLOTS)
+		{
+			// Whole control cycle
+			#pragma GCC unroll 64
+			for (uint8_t slot = 0; slot < USYNTH_CONTROL_SLOTS; slot++)
+			{
+				usynth_control_slot(synth, slot);
+				*out++ = usynth_sample(synth);
+			}
+			frames -= USYNTH_CONTROL_SLOTS;
+		}
+		else
 		{
-			if (load_balancer_cnt == MIDI_CTL(MIDI_DEBUG_CHANNEL)) PORTD |= (1 << LED_GRN_PIN);
+			// Partial control cycle at the beginning or at the end
+			usynth_control_slot(synth, synth->load_balancer_cnt++);
+			*out++ = usynth_sample(synth);
+			frames--;
 		}
-		PORTD &= ~(1 << LED_GRN_PIN);
-		dac_sent = 0;
 	}
 }
@@ -1,9 +1,15 @@
 #ifndef USYNTH_H
 #define USYNTH_H
 
+#include <inttypes.h>
+#include <stddef.h>
 #include "ppg/ppg_osc.h"
 #include "eg.h"
 #include "lfo.h"
+#include "filter.h"
+#include "midi.h"
+#include "profile.h"
+#include "health.h"
 
 // LED IO defs
 #define LED_1_PIN 2
@@ -19,6 +25,81 @@
 #define MOSI_PIN  3
 #define SCK_PIN   5
 
+//! Number of voices per chip
+#ifndef USYNTH_VOICES
+#define USYNTH_VOICES 2
+#endif
+
+#if USYNTH_VOICES < 2 || USYNTH_VOICES > 4
+#error USYNTH_VOICES must be 2, 3 or 4
+#endif
+
+/*
+	Control cycle (load balancer) layout - each slot is one sample.
+	With 2 voices the cycle is 21 samples long:
+
+		0-2    MIDI bytes (up to USYNTH_MIDI_BURST each)
+		3-6    MIDI CC updates (2 per voice)
+		7      gates
+		8-9    notes
+		10-11  globals
+		12-13  amp EGs, MIDI backlog
+		14-15  mod EGs, MIDI backlog
+		16-17  LFOs, MIDI backlog
+		18-19  modulation, MIDI backlog
+		20     LEDs, counter reset
+
+	Every additional voice adds 7 voice slots and a MIDI slot,
+	so that MIDI data at full baud rate can still be read in time.
+*/
+#define USYNTH_MIDI_SLOTS          (USYNTH_VOICES + 1)
+
+/*
+	Controller changes, pitch bends and status bytes only store a value,
+	so a MIDI slot keeps reading them up to this many bytes. Notes and
+	program changes end the slot. A backlog of CC data (after a program
+	change or a burst from the host) thus drains several times faster
+	than one byte per slot and doesn't delay the notes queued behind it.
+	Only the latest value of each controller is applied - the CC update
+	slots run after the MIDI slots and once per dirty controller.
+*/
+#ifndef USYNTH_MIDI_BURST
+#define USYNTH_MIDI_BURST 4
+#endif
+
+/*
+	The EG, LFO and modulation slots leave most of the sample period
+	unused, so each of them also reads up to this many bytes when there
+	is a backlog. That gives 3 * 4 + 8 * 2 = 28 bytes per cycle with
+	2 voices, enough for a 115200 baud link. Program changes and patch
+	dumps are left for the MIDI slots - loading them would make those
+	slots late.
+*/
+#ifndef USYNTH_MIDI_SPARE_BURST
+#define USYNTH_MIDI_SPARE_BURST 2
+#endif
+
+#define USYNTH_SLOT_MIDI           0
+#define USYNTH_SLOT_CC(i)          (USYNTH_SLOT_MIDI + USYNTH_MIDI_SLOTS + 2 * (i))
+#define USYNTH_SLOT_GATES          USYNTH_SLOT_CC(USYNTH_VOICES)
+#define USYNTH_SLOT_NOTE(i)        (USYNTH_SLOT_GATES + 1 + (i))
+#define USYNTH_SLOT_GLOBAL         USYNTH_SLOT_NOTE(USYNTH_VOICES)
+#define USYNTH_SLOT_AMP_EG(i)      (USYNTH_SLOT_GLOBAL + 2 + (i))
+#define USYNTH_SLOT_MOD_EG(i)      (USYNTH_SLOT_AMP_EG(USYNTH_VOICES) + (i))
+#define USYNTH_SLOT_LFO(i)         (USYNTH_SLOT_MOD_EG(USYNTH_VOICES) + (i))
+#define USYNTH_SLOT_MOD(i)         (USYNTH_SLOT_LFO(USYNTH_VOICES) + (i))
+#define USYNTH_SLOT_LEDS           USYNTH_SLOT_MOD(USYNTH_VOICES)
+
+//! Number of samples in one control cycle (load balancer slots)
+#define USYNTH_CONTROL_SLOTS (USYNTH_SLOT_LEDS + 1)
+
+// SysEx manufacturer ID (non-commercial) and report IDs
+#define USYNTH_SYSEX_ID        MIDI_SYSEX_ID
+#define USYNTH_REPORT_NONE     0
+#define USYNTH_REPORT_PROFILE  1
+#define USYNTH_REPORT_HEALTH   2
+#define USYNTH_REPORT_PATCH    MIDI_SYSEX_PATCH
+
 // DAC config bits
 #define MCP4921_DAC_AB_BIT   (1 << 15)
 #define MCP4921_VREF_BUF_BIT (1 << 14)
@@ -42,5 +123,137 @@ typedef struct usynth_voice
 	uint8_t wavetable_number;
 } usynth_voice;
 
+/**
+	Complete state of one synthesizer (one chip)
+*/
+typedef struct usynth_instance
+{
+	// Synth
+	usynth_voice voices[USYNTH_VOICES];
+	filter1pole filter;
+	int8_t filter_cutoff;
+
+	/**
+		Wavetables used by the voices and a spare one. New wavetables
+		are loaded into the spare one over many control cycles and then
+		swapped with the one the voice uses.
+	*/
+	ppg_wavetable_entry wavetables[USYNTH_VOICES + 1][PPG_DEFAULT_WAVETABLE_SIZE];
+	ppg_wavetable_loader wavetable_loader;
+	usynth_voice *wavetable_load_voice; //!< Voice waiting for the wavetable being loaded
+
+	// MIDI
+	midi_status midi;
+	uint8_t poly_mode;
+	uint8_t midi_voice_offset;
+
+	/**
+		MIDI data ring buffer - on AVR written in interrupt,
+		read in the main loop
+	*/
+	volatile uint8_t midi_buffer[256];
+	volatile uint8_t midi_wcnt;
+	uint8_t midi_rcnt;
+	usynth_midi_health midi_health;    //!< Written with midi_buffer, see health.h
+
+	// Data of the report being transmitted, taken when it's requested
+	union
+	{
+		usynth_health_counters health_report;
+		uint8_t patch_report[MIDI_PATCH_SIZE];
+	};
+
+	// Current position in the control cycle
+	uint8_t load_balancer_cnt;
+
+	// Report being transmitted over MIDI and current position in it
+	uint8_t tx_report;
+	uint16_t tx_pos;
+
+#ifdef USYNTH_PROFILE
+	usynth_slot_profile profile[USYNTH_CONTROL_SLOTS];
+#endif
+} usynth_instance;
+
+//! Returns number of bytes that can be added to the MIDI input buffer
+static inline uint8_t usynth_midi_space(const usynth_instance *synth)
+{
+	return 255 - (uint8_t)(synth->midi_wcnt - synth->midi_rcnt);
+}
+
+/**
+	Appends one byte to the MIDI input buffer. A message that doesn't fit
+	in the buffer is dropped whole (see health.h).
+*/
+static inline void usynth_midi_put(usynth_instance *synth, uint8_t byte)
+{
+	usynth_midi_health *h = &synth->midi_health;
+	uint8_t wcnt = synth->midi_wcnt;
+	uint8_t space = usynth_midi_space(synth);
+
+	// Real-time messages are single bytes and may appear anywhere
+	if (byte >= 0xf8)
+	{
+		if (!space)
+		{
+			usynth_health_count(&h->counters.dropped_bytes);
+			usynth_health_count(&h->counters.dropped_messages);
+			return;
+		}
+	}
+	else
+	{
+		if (byte & (1 << 7))
+		{
+			h->rx_status = byte < 0xf0 ? byte : 0;
+			h->rx_len = usynth_health_msg_len(byte);
+			h->rx_left = 0;
+			h->rx_resend = 0;
+		}
+		else if (h->rx_drop && !h->rx_status)
+		{
+			// Data of a dropped message without running status (SysEx)
+			// can't be told apart from new messages, so all of it goes
+			usynth_health_count(&h->counters.dropped_bytes);
+			return;
+		}
+
+		// The first byte of a message decides whether all of it fits
+		if (!h->rx_left)
+		{
+			h->rx_left = (byte >> 7) + h->rx_len;
+			if (!h->rx_left) h->rx_left = 1;
+
+			h->rx_drop = h->rx_left + h->rx_resend > space;
+			if (h->rx_drop)
+			{
+				usynth_health_count(&h->counters.dropped_messages);
+				if (byte & (1 << 7)) h->rx_resend = h->rx_status != 0;
+			}
+			else if (h->rx_resend)
+			{
+				synth->midi_buffer[wcnt++] = h->rx_status;
+				h->rx_resend = 0;
+			}
+		}
+
+		h->rx_left--;
+		if (h->rx_drop)
+		{
+			usynth_health_count(&h->counters.dropped_bytes);
+			return;
+		}
+	}
+
+	synth->midi_buffer[wcnt++] = byte;
+	synth->midi_wcnt = wcnt;
+
+	uint8_t used = wcnt - synth->midi_rcnt;
+	if (used > h->counters.high_water) h->counters.high_water = used;
+}
+
+extern void usynth_init(usynth_instance *synth);
+extern uint16_t usynth_update(usynth_instance *synth);
+extern void usynth_render(usynth_instance *synth, int16_t *out, size_t frames);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,138 @@
+#include "usynth.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <inttypes.h>
+
+#include "hal.h"
+#include "midi_cc.h"
+
+/**
+	\file Firmware entry point - hardware setup, DAC interrupt and the main loop
+*/
+
+#ifndef F_CPU
+#error F_CPU is not defined!
+#endif
+
+#ifndef F_SAMPLE
+#error F_SAMPLE is not defined!
+#endif
+
+#ifndef MIDI_BAUD
+#warning MIDI_BAUD is not defined! Assuming default 31250
+#define MIDI_BAUD 31250
+#endif
+
+// The synth
+static usynth_instance synth;
+
+/**
+	Main interrupt - sends a new sample to the DAC
+*/
+static volatile uint16_t dac_data = 0;
+static volatile uint8_t dac_sent = 0;
+ISR(TIMER1_COMPB_vect)
+{
+	// CS is automatically set low, but LDAC needs to be forced high
+	TCCR1A |= (1 << COM1A0);
+	TCCR1C |= (1 << FOC1A);
+	TCCR1A &= ~(1 << COM1A1);
+
+	const uint16_t mcp4921_conf = MCP4921_SHDN_BIT | MCP4921_GAIN_BIT | MCP4921_VREF_BUF_BIT;
+	uint16_t data = mcp4921_conf | (dac_data >> 4);
+	
+	// Send the data via SPI
+	SPDR = data >> 8;
+	while (!(SPSR & (1 << SPIF)));
+	SPDR = data;
+	while (!(SPSR & (1 << SPIF)));
+	
+	// Force compare event to set CS high
+	TCCR1A |= (1 << COM1B0);
+	TCCR1C |= (1 << FOC1B);
+	TCCR1A &= ~(1 << COM1B1);
+	
+	// Check incoming USART data and buffer it
+	// No need for a while loop here - this interrupt
+	// is frequent enough
+	if (UCSR0A & (1 << RXC0))
+		usynth_midi_put(&synth, UDR0);
+
+	// Set sent flag, so the main loop can work again
+	dac_sent = 1;
+}
+
+int main(void)
+{
+	// LEDs
+	DDRD |= (1 << LED_1_PIN) | (1 << LED_2_PIN) | (1 << LED_3_PIN);
+	
+	// 10 MHz SPI Master, DAC IO
+	PORTB |= (1 << LDAC_PIN) | (1 << CS_PIN);
+	DDRB |= (1 << LDAC_PIN) | (1 << CS_PIN) | (1 << MOSI_PIN) | (1 << SCK_PIN);
+	SPCR = (1 << SPE) | (1 << MSTR);
+	SPSR = (1 << SPI2X);
+	
+	/*
+		TIMER 1 - CTC mode, F_CPU
+
+		- Clear OC1B (CS) on compare
+		- Clear OC1A (LDAC) on compare
+		- COMP1B ISR active
+
+		Event:    COMPB       FORCE
+		__   _______|    ISR    |__________
+		CS          |___________|
+
+		Event:      FORCE           COMPA
+		____          |_______________|
+		LDAC _________|               |____
+	*/
+	TCCR1A = (1 << COM1A1) | (1 << COM1B1);
+	TCCR1B = (1 << WGM12) | (1 << CS10);
+	TIMSK1 = (1 << OCIE1B);
+ 	OCR1A = F_CPU / F_SAMPLE - 1;
+ 	OCR1B = 4; // Determines LDAC pulse width (must be over 100ns)
+	
+	// USART0 - MIDI, 8 bit data, 1 bit stop, no parity
+	UBRR0 = F_CPU / 16 / MIDI_BAUD - 1;
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+	UCSR0C = (1 << UCSZ00) | (1<< UCSZ01);
+	
+	// -------------- HW init done
+
+	usynth_init(&synth);
+
+	sei();
+
+	// The main loop
+	while (1)
+	{
+#ifdef USYNTH_PROFILE
+		uint8_t slot = synth.load_balancer_cnt;
+#endif
+
+		// Output sample
+		dac_data = usynth_update(&synth);
+
+#ifdef USYNTH_PROFILE
+		// Cycles left until the next sample - the timer restarts at OCR1A
+		// and the interrupt fires at OCR1B, so anything below that is late
+		uint16_t tcnt = TCNT1;
+		uint16_t headroom = dac_sent || tcnt <= OCR1B ? 0 : OCR1A - tcnt;
+		usynth_profile_record(&synth.profile[slot], headroom);
+#endif
+
+		// The interrupt didn't wait for this sample and sent the previous one again
+		if (dac_sent)
+			usynth_health_count(&synth.midi_health.counters.late_samples);
+
+		// Wait for the 'sent' flag and clear it
+		while (!dac_sent)
+		{
+			if (synth.load_balancer_cnt == synth.midi.control[MIDI_DEBUG_CHANNEL]) PORTD |= (1 << LED_GRN_PIN);
+		}
+		PORTD &= ~(1 << LED_GRN_PIN);
+		dac_sent = 0;
+	}
+}
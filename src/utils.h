@@ -2,7 +2,7 @@
 #define UTILS_H
 
 #include <inttypes.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -5,7 +5,7 @@ F_SAMPLE = 28000
 
 print("""#include "notes_table.h"
 #include <inttypes.h>
-#include <avr/pgmspace.h>
+#include "../hal.h"
 
 /**
 	Compressed note frequency table